@@ -18,8 +18,18 @@
 
 #include "stackalloc.h"
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #ifdef _WIN32
     #define VC_EXTRALEAN
@@ -27,8 +37,22 @@
     #define NOMINMAX
     #include <windows.h>
     #include <memoryapi.h>
+    #include <io.h>
+    #include <fcntl.h>
 #else
     #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <signal.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
 #endif
 
 namespace sa {
@@ -73,7 +97,10 @@ LONG WINAPI guard_page_exception_filter(_EXCEPTION_POINTERS *ep) {
                                         : EXCEPTION_CONTINUE_SEARCH;
 }
 
-uint8_t *alloc_stack_address_space(size_t size) {
+uint8_t *alloc_stack_address_space(size_t size, page_mode &mode, size_t) {
+    // Large pages on Windows need special privileges and must be committed
+    // up front, which defeats the point of reserving address space.
+    mode = page_mode::normal;
     if (!page_size) {
         // SetUnhandledExceptionFilter doesn't actually stop on
         // STATUS_GUARD_PAGE_VIOLATION, but this one does:
@@ -92,16 +119,329 @@ void dealloc_stack_address_space(uint8_t *mem, size_t) {
     VirtualFree(mem, 0, MEM_RELEASE);
 }
 
+void reclaim_stack_address_space(uint8_t *mem, size_t size, bool lazy) {
+    auto start = (uint8_t *)(((size_t)mem + page_size - 1) & ~(page_size - 1));
+    if (start >= mem + size) return;
+    if (lazy) {
+        VirtualAlloc(start, mem + size - start, MEM_RESET, PAGE_READWRITE);
+    } else {
+        // Accessing these again will simply re-commit them thru the
+        // exception filter above.
+        VirtualFree(start, mem + size - start, MEM_DECOMMIT);
+    }
+}
+
+size_t system_page_size() {
+    return page_size;
+}
+
+// Debug guard pages are not supported on Windows yet: the exception filter
+// above would simply commit them again.
+void protect_guard_page(stack *, uint8_t *) {}
+void unprotect_guard_page(uint8_t *) {}
+
+static long current_thread_id() {
+    return static_cast<long>(GetCurrentThreadId());
+}
+
+// Windows commits on demand, which is what resident means here too.
+// Nothing to prepare, VirtualQuery is cheap enough per stack.
+struct memory_snapshot {
+    void take() {}
+};
+
+static void query_stack_memory(const memory_snapshot &, uint8_t *mem, size_t extent,
+                               size_t &resident, size_t &committed) {
+    resident = committed = 0;
+    for (auto p = mem; p < mem + extent;) {
+        MEMORY_BASIC_INFORMATION info;
+        if (!VirtualQuery(p, &info, sizeof(info))) break;
+        auto region_end = static_cast<uint8_t *>(info.BaseAddress) + info.RegionSize;
+        if (info.State == MEM_COMMIT) {
+            auto e = region_end < mem + extent ? region_end : mem + extent;
+            committed += e - p;
+        }
+        p = region_end;
+    }
+    resident = committed;
+}
+
 #else
 
-uint8_t *alloc_stack_address_space(size_t size) {
-    auto vp = mmap(nullptr, size, PROT_READ | PROT_WRITE,
-                   MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
-    return vp == MAP_FAILED ? nullptr : vp;
+static long current_thread_id() {
+    return static_cast<long>(syscall(SYS_gettid));
+}
+
+enum {
+    // Inaccessible address space after each stack, such that running off the
+    // end crashes right there, rather than corrupting whatever is mapped
+    // next. Huge page sized, such that it works for all page modes.
+    GUARD_SIZE = 1 << 21,
+    // How many guard regions we can tell apart in diagnostics at once.
+    MAX_GUARD_REGIONS = 1 << 14,
+};
+
+size_t system_page_size() {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+static const auto relaxed = std::memory_order_relaxed;
+
+// All guard regions in the process, such that the SIGSEGV handler can tell
+// which stack overflowed. Only changes when stacks are created or destroyed
+// (or per vector_max in debug mode), and must be readable from a signal
+// handler, hence a fixed size table with atomic claiming of slots. A slot is
+// live once `begin` is release-stored after its other fields; those are
+// atomic too, as slots get reused while other threads scan the table.
+struct guard_region {
+    std::atomic<uint8_t *> begin { nullptr };
+    std::atomic<uint8_t *> end { nullptr };
+    std::atomic<uint8_t *> stack_memory { nullptr };
+    std::atomic<long> thread { 0 };
+    std::atomic<size_t> index { 0 };
+    std::atomic<bool> vector_max { false };
+};
+
+static guard_region guard_regions[MAX_GUARD_REGIONS];
+static uint8_t *const claimed_region = reinterpret_cast<uint8_t *>(1);
+static struct sigaction previous_segv_action;
+
+static void write_diagnostic(const char *s) {
+    auto r = write(STDERR_FILENO, s, strlen(s));
+    (void)r;
+}
+
+static void write_diagnostic(size_t n, bool hex) {
+    char buf[32];
+    auto p = buf + sizeof(buf);
+    *--p = 0;
+    do {
+        *--p = "0123456789abcdef"[n % (hex ? 16 : 10)];
+        n /= hex ? 16 : 10;
+    } while (n);
+    if (hex) {
+        *--p = 'x';
+        *--p = '0';
+    }
+    write_diagnostic(p);
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *context) {
+    auto addr = static_cast<uint8_t *>(info->si_addr);
+    for (auto &g : guard_regions) {
+        auto begin = g.begin.load(std::memory_order_acquire);
+        if (!begin || begin == claimed_region || addr < begin || addr >= g.end.load(relaxed)) continue;
+        write_diagnostic(g.vector_max.load(relaxed) ? "stackalloc: overflow past vector_max capacity on stack "
+                                                    : "stackalloc: overflow past the end of stack ");
+        auto index = g.index.load(relaxed);
+        if (index != SIZE_MAX) {
+            write_diagnostic("#");
+            write_diagnostic(index, false);
+            write_diagnostic(" ");
+        }
+        write_diagnostic("at ");
+        write_diagnostic(reinterpret_cast<size_t>(g.stack_memory.load(relaxed)), true);
+        write_diagnostic(" (thread ");
+        write_diagnostic(g.thread.load(relaxed), false);
+        write_diagnostic("), accessing ");
+        write_diagnostic(reinterpret_cast<size_t>(addr), true);
+        write_diagnostic("\n");
+        // Returning re-executes the faulting instruction, which then crashes
+        // normally, so a debugger / core dump shows where it happened.
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    // Not ours.
+    if (previous_segv_action.sa_flags & SA_SIGINFO) {
+        previous_segv_action.sa_sigaction(sig, info, context);
+    } else if (previous_segv_action.sa_handler != SIG_DFL &&
+               previous_segv_action.sa_handler != SIG_IGN) {
+        previous_segv_action.sa_handler(sig);
+    } else {
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+// The index of the stack at `stack_memory`, from its own guard region.
+static size_t stack_index(uint8_t *stack_memory) {
+    for (auto &g : guard_regions) {
+        auto begin = g.begin.load(std::memory_order_acquire);
+        if (begin && begin != claimed_region && !g.vector_max.load(relaxed) &&
+            g.stack_memory.load(relaxed) == stack_memory) {
+            return g.index.load(relaxed);
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void register_guard_region(uint8_t *begin, uint8_t *end, uint8_t *stack_memory,
+                                  bool vector_max, size_t index) {
+    static bool installed = []() {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = segv_handler;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        return sigaction(SIGSEGV, &action, &previous_segv_action) == 0;
+    }();
+    (void)installed;
+    for (auto &g : guard_regions) {
+        uint8_t *expected = nullptr;
+        if (g.begin.compare_exchange_strong(expected, claimed_region)) {
+            g.end.store(end, relaxed);
+            g.stack_memory.store(stack_memory, relaxed);
+            g.thread.store(current_thread_id(), relaxed);
+            g.index.store(index, relaxed);
+            g.vector_max.store(vector_max, relaxed);
+            g.begin.store(begin, std::memory_order_release);
+            return;
+        }
+    }
+    // Table full: these still crash, just without a diagnostic.
+}
+
+static void unregister_guard_region(uint8_t *begin) {
+    for (auto &g : guard_regions) {
+        if (g.begin.load(std::memory_order_relaxed) == begin) {
+            g.begin.store(nullptr, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+void protect_guard_page(stack *st, uint8_t *page) {
+    mprotect(page, system_page_size(), PROT_NONE);
+    register_guard_region(page, page + system_page_size(), st->memory, true, stack_index(st->memory));
+}
+
+void unprotect_guard_page(uint8_t *page) {
+    unregister_guard_region(page);
+    mprotect(page, system_page_size(), PROT_READ | PROT_WRITE);
+}
+
+static uint8_t *add_guard(uint8_t *mem, size_t size, size_t index) {
+    mprotect(mem + size, GUARD_SIZE, PROT_NONE);
+    register_guard_region(mem + size, mem + size + GUARD_SIZE, mem, false, index);
+    return mem;
+}
+
+uint8_t *alloc_stack_address_space(size_t size, page_mode &mode, size_t index) {
+    #ifdef MAP_HUGETLB
+        if (mode == page_mode::explicit_huge) {
+            // No MAP_NORESERVE here, since without a reservation we'd get a
+            // SIGBUS on first touch once the pool runs dry, rather than a
+            // failure here that we can fall back from.
+            auto vp = mmap(nullptr, size + GUARD_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+            if (vp != MAP_FAILED) return add_guard(static_cast<uint8_t *>(vp), size, index);
+        }
+    #endif
+    #ifdef MADV_HUGEPAGE
+        if (mode != page_mode::normal) {
+            // Huge pages can only be used for 2MB aligned ranges, so reserve
+            // a bit extra and trim it down.
+            const size_t huge_page = 1 << 21;
+            auto vp = mmap(nullptr, size + GUARD_SIZE + huge_page, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+            if (vp == MAP_FAILED) return nullptr;
+            auto raw = static_cast<uint8_t *>(vp);
+            auto mem = (uint8_t *)(((size_t)raw + huge_page - 1) & ~(huge_page - 1));
+            if (mem > raw) munmap(raw, mem - raw);
+            munmap(mem + size + GUARD_SIZE, raw + huge_page - mem);
+            madvise(mem, size, MADV_HUGEPAGE);
+            mode = page_mode::transparent_huge;
+            return add_guard(mem, size, index);
+        }
+    #endif
+    mode = page_mode::normal;
+    auto vp = mmap(nullptr, size + GUARD_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    return vp == MAP_FAILED ? nullptr : add_guard(static_cast<uint8_t *>(vp), size, index);
 }
 
 void dealloc_stack_address_space(uint8_t *mem, size_t size) {
-    munmap(mem, size);
+    unregister_guard_region(mem + size);
+    munmap(mem, size + GUARD_SIZE);
+}
+
+// Since stacks are mapped with MAP_NORESERVE, the kernel doesn't commit
+// anything beyond what is resident (or swapped out, which we can't see here).
+static size_t mincore_resident(uint8_t *mem, size_t extent) {
+    auto page_size = system_page_size();
+    auto pages = (extent + page_size - 1) / page_size;
+    size_t resident = 0;
+    const size_t pages_at_once = 1 << 16;
+    unsigned char in_core[pages_at_once];
+    for (size_t i = 0; i < pages; i += pages_at_once) {
+        auto n = std::min(pages - i, pages_at_once);
+        if (mincore(mem + i * page_size, n * page_size, in_core)) break;
+        for (size_t j = 0; j < n; j++) resident += (in_core[j] & 1) * page_size;
+    }
+    return resident;
+}
+
+// Resident sizes of all mappings, from one read of /proc/self/smaps, since
+// mincore over whole (mostly untouched) reservations is slow.
+struct memory_snapshot {
+    struct region {
+        uint8_t *begin, *end;
+        size_t rss;
+    };
+    std::vector<region> regions;
+    bool ok = false;
+
+    void take() {
+        auto f = fopen("/proc/self/smaps", "r");
+        if (!f) return;
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+            size_t b, e, kb;
+            if (sscanf(line, "%zx-%zx ", &b, &e) == 2) {
+                regions.push_back({ reinterpret_cast<uint8_t *>(b), reinterpret_cast<uint8_t *>(e), 0 });
+            } else if (!regions.empty() && sscanf(line, "Rss: %zu kB", &kb) == 1) {
+                regions.back().rss = kb * 1024;
+            }
+        }
+        fclose(f);
+        ok = !regions.empty();
+    }
+};
+
+static void query_stack_memory(const memory_snapshot &snap, uint8_t *mem, size_t extent,
+                               size_t &resident, size_t &committed) {
+    if (!snap.ok) {
+        resident = committed = mincore_resident(mem, extent);
+        return;
+    }
+    resident = 0;
+    auto end = mem + extent;
+    // Regions are in address order.
+    auto it = std::lower_bound(snap.regions.begin(), snap.regions.end(), mem,
+                               [](const memory_snapshot::region &r, uint8_t *p) { return r.end <= p; });
+    for (; it != snap.regions.end() && it->begin < end; ++it) {
+        if (it->begin >= mem && it->end <= end) {
+            resident += it->rss;
+        } else {
+            // Merged with a neighbouring mapping, so only count our part.
+            auto b = std::max(it->begin, mem), e = std::min(it->end, end);
+            resident += mincore_resident(b, e - b);
+        }
+    }
+    committed = resident;
+}
+
+void reclaim_stack_address_space(uint8_t *mem, size_t size, bool lazy) {
+    auto page_size = system_page_size();
+    auto start = (uint8_t *)(((size_t)mem + page_size - 1) & ~(page_size - 1));
+    if (start >= mem + size) return;
+    #ifdef MADV_FREE
+        auto advice = lazy ? MADV_FREE : MADV_DONTNEED;
+    #else
+        (void)lazy;
+        auto advice = MADV_DONTNEED;
+    #endif
+    madvise(start, mem + size - start, advice);
 }
 
 #endif
@@ -109,31 +449,995 @@ void dealloc_stack_address_space(uint8_t *mem, size_t size) {
 
 // Implementation of automatic stack management.
 
-static size_t locked = 0;
-static size_t allocated = 0;
-static const size_t DEFAULT_LARGE_STACK = 1ULL << 36;  // 64GB? Why not?
-static const size_t DEFAULT_MAX_STACKS = 1ULL << 10;
-static stack stacks[DEFAULT_MAX_STACKS];
+// Every thread gets its own set of stacks, so acquiring and releasing never
+// needs any synchronization. The registry is created on first use, and
+// its stacks are returned to the OS when the thread exits.
+// Note that this means vectors must be destroyed on the thread that created
+// them, which follows naturally from them being owned by local variables.
+
+// The defaults live in config in the header.
+static config global_config;
+static bool config_initialized = false;
+// Lowered whenever the system refuses to reserve a stack this big, such that
+// no thread keeps trying sizes that won't work.
+static std::atomic<size_t> max_working_stack_size { SIZE_MAX };
+// Stacks reserved across all threads.
+static std::atomic<size_t> total_stacks { 0 };
+
+// A whole number with an optional K/M/G/T suffix, and nothing else.
+static bool parse_size(const char *s, size_t &size) {
+    if (*s < '0' || *s > '9') return false;
+    char *end;
+    errno = 0;
+    auto n = strtoull(s, &end, 10);
+    if (errno) return false;
+    int shift = 0;
+    switch (*end) {
+        case 'T': case 't': shift = 40; break;
+        case 'G': case 'g': shift = 30; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'K': case 'k': shift = 10; break;
+        case 0: break;
+        default: return false;
+    }
+    if (shift && *++end) return false;
+    if (n > (SIZE_MAX >> shift)) return false;
+    size = static_cast<size_t>(n) << shift;
+    return true;
+}
+
+static void apply_environment(size_t &value, const char *name) {
+    auto e = getenv(name);
+    if (e && !parse_size(e, value)) {
+        fprintf(stderr, "stackalloc: ignoring invalid %s=%s\n", name, e);
+    }
+}
+
+static void apply_environment(config &cfg) {
+    apply_environment(cfg.stack_size, "SA_STACK_SIZE");
+    apply_environment(cfg.min_stack_size, "SA_MIN_STACK_SIZE");
+    apply_environment(cfg.max_stacks_per_thread, "SA_MAX_STACKS_PER_THREAD");
+    apply_environment(cfg.max_stacks, "SA_MAX_STACKS");
+}
+
+// Stack sizes must be whole pages (huge pages in huge page modes), or the
+// guard after each stack can't be protected.
+static size_t stack_granularity(page_mode mode) {
+    return mode == page_mode::normal ? system_page_size() : size_t(1) << 21;
+}
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+static void sanitize(config &cfg) {
+    auto granularity = stack_granularity(cfg.pages);
+    cfg.min_stack_size = round_up(std::max<size_t>(cfg.min_stack_size, 1), granularity);
+    cfg.stack_size = round_up(std::max(cfg.stack_size, cfg.min_stack_size), granularity);
+    cfg.max_stacks_per_thread = std::max<size_t>(cfg.max_stacks_per_thread, 1);
+}
+
+[[noreturn]] static void fatal(const char *msg) {
+    fprintf(stderr, "stackalloc: %s\n", msg);
+    assert(false);
+    abort();
+}
+
+template<typename T> static T get(const std::atomic<T> &a) {
+    return a.load(std::memory_order_relaxed);
+}
+
+template<typename T> static void set(std::atomic<T> &a, T v) {
+    a.store(v, std::memory_order_relaxed);
+}
+
+struct stack_registry {
+    // Only ever written by the owning thread, so these compile to plain loads
+    // and stores, but stats() may read them from other threads.
+    std::atomic<size_t> locked { 0 };
+    std::atomic<size_t> allocated { 0 };
+    long thread = current_thread_id();
+    #if SA_STATS
+        std::atomic<size_t> acquires { 0 };
+        std::atomic<size_t> releases { 0 };
+        std::atomic<size_t> peak_locked { 0 };
+    #endif
+    reclaim_policy reclaim;
+    page_mode pages = page_mode::normal;
+    size_t max_stacks;
+    // Copied from the config, which init() may change at any time.
+    size_t max_total_stacks;
+    size_t stack_size;
+    size_t min_stack_size;
+    stack *stacks;
+    // Stacks can be released in any order, so the unlocked ones (below
+    // allocated) are kept as a stack of indices, most recently released on
+    // top, since those are most likely to still be resident.
+    size_t *free_stacks;
+    size_t num_free = 0;
+    std::atomic<bool> *in_use;
+    // The thread is exiting, but some stacks are still locked.
+    bool orphaned = false;
+
+    stack_registry(const config &cfg)
+        : reclaim(cfg.reclaim), pages(cfg.pages), max_stacks(cfg.max_stacks_per_thread),
+          max_total_stacks(cfg.max_stacks), stack_size(cfg.stack_size),
+          min_stack_size(cfg.min_stack_size),
+          stacks(new stack[cfg.max_stacks_per_thread]),
+          free_stacks(new size_t[cfg.max_stacks_per_thread]),
+          in_use(new std::atomic<bool>[cfg.max_stacks_per_thread]()) {}
+
+    ~stack_registry() {
+        total_stacks -= get(allocated);
+        delete[] in_use;
+        delete[] free_stacks;
+        delete[] stacks;
+    }
+};
+
+// All registries, such that stats() can find them. Only touched when threads
+// start or stop using stacks. Created on first use and never destructed,
+// since containers with static storage duration may use stacks during
+// static initialization and destruction.
+static std::mutex &registries_mutex() {
+    static auto m = new std::mutex;
+    return *m;
+}
+
+static std::vector<stack_registry *> &registries() {
+    static auto v = new std::vector<stack_registry *>;
+    return *v;
+}
+
+// A plain pointer, such that the hot path is a single TLS load without the
+// lazy-init guard that a thread_local object with a destructor would need.
+static thread_local stack_registry *registry = nullptr;
+
+static void destroy_registry() {
+    {
+        std::lock_guard<std::mutex> lock(registries_mutex());
+        auto &all = registries();
+        all.erase(std::find(all.begin(), all.end(), registry));
+    }
+    delete registry;
+    registry = nullptr;
+}
+
+struct registry_owner {
+    ~registry_owner() {
+        if (!registry) return;
+        // On the main thread, containers with static storage duration are
+        // only destructed after this, so keep it around until they're gone.
+        if (get(registry->locked)) {
+            registry->orphaned = true;
+        } else {
+            destroy_registry();
+        }
+    }
+};
+
+static void init_locked(const config &cfg) {
+    global_config = cfg;
+    apply_environment(global_config);
+    sanitize(global_config);
+    config_initialized = true;
+}
+
+void init(const config &cfg) {
+    std::lock_guard<std::mutex> lock(registries_mutex());
+    init_locked(cfg);
+}
+
+config current_config() {
+    std::lock_guard<std::mutex> lock(registries_mutex());
+    if (!config_initialized) init_locked(config());
+    return global_config;
+}
+
+static stack_registry *create_registry() {
+    // Constructed the first time this thread gets here, destructed at
+    // thread exit.
+    static thread_local registry_owner owner;
+    (void)owner;
+    std::lock_guard<std::mutex> lock(registries_mutex());
+    if (!config_initialized) init_locked(config());
+    registry = new stack_registry(global_config);
+    registries().push_back(registry);
+    return registry;
+}
+
+// Slow path of acquire_stack().
+static void reserve_stack(stack_registry *r, size_t index) {
+    if (index == r->max_stacks) {
+        // We should really never get here unless we're being called
+        // in a non-stack way.
+        fatal("too many stacks in use by this thread (see max_stacks_per_thread)");
+    }
+    auto max_stacks = r->max_total_stacks;
+    if (++total_stacks > max_stacks && max_stacks) {
+        total_stacks--;
+        fatal("too many stacks in use by all threads (see max_stacks)");
+    }
+    auto &st = r->stacks[index];
+    // System doesn't like us allocating this much address space?
+    // Try smaller sizes, since most uses don't need anywhere near this much.
+    auto granularity = stack_granularity(r->pages);
+    auto size = std::max(std::min(r->stack_size, max_working_stack_size.load()), r->min_stack_size);
+    while (!st.alloc(size, r->pages, index)) {
+        size = size / 2 / granularity * granularity;
+        if (size < r->min_stack_size) {
+            total_stacks--;
+            fatal("cannot reserve address space for a stack");
+        }
+        max_working_stack_size = size;
+    }
+    st.reclaim = r->reclaim;
+    // Publishes the new stack to stats().
+    r->allocated.store(index + 1, std::memory_order_release);
+}
 
 stack *acquire_stack() {
-    if (allocated == locked) {
-        if (allocated == DEFAULT_MAX_STACKS) {
-            // We should really never get here unless we're being called
-            // in a non-stack way.
-            assert(false);
-            abort();
+    auto r = registry ? registry : create_registry();
+    size_t index;
+    if (r->num_free) {
+        index = r->free_stacks[--r->num_free];
+    } else {
+        index = get(r->allocated);
+        reserve_stack(r, index);
+    }
+    set(r->in_use[index], true);
+    auto locked = get(r->locked) + 1;
+    set(r->locked, locked);
+    #if SA_STATS
+        set(r->acquires, get(r->acquires) + 1);
+        if (locked > get(r->peak_locked)) set(r->peak_locked, locked);
+    #endif
+    return &r->stacks[index];
+}
+
+void release_stack(stack *st) {
+    auto r = registry;
+    assert(r && st >= r->stacks && st < r->stacks + get(r->allocated));
+    auto index = static_cast<size_t>(st - r->stacks);
+    assert(get(r->in_use[index]));
+    set(r->in_use[index], false);
+    r->free_stacks[r->num_free++] = index;
+    set(r->locked, get(r->locked) - 1);
+    #if SA_STATS
+        set(r->releases, get(r->releases) + 1);
+    #endif
+    if (r->orphaned && !get(r->locked)) destroy_registry();
+}
+
+void set_reclaim_policy(const reclaim_policy &policy) {
+    auto r = registry ? registry : create_registry();
+    r->reclaim = policy;
+    for (size_t i = 0; i < get(r->allocated); i++) r->stacks[i].reclaim = policy;
+}
+
+void set_page_mode(page_mode mode) {
+    auto r = registry ? registry : create_registry();
+    r->pages = mode;
+}
+
+global_stats stats() {
+    global_stats gs;
+    memory_snapshot snap;
+    snap.take();
+    std::lock_guard<std::mutex> lock(registries_mutex());
+    for (auto r : registries()) {
+        auto allocated = r->allocated.load(std::memory_order_acquire);
+        gs.reserved_stacks += allocated;
+        gs.locked_stacks += get(r->locked);
+        #if SA_STATS
+            gs.acquires += get(r->acquires);
+            gs.releases += get(r->releases);
+            gs.peak_locked = std::max(gs.peak_locked, get(r->peak_locked));
+        #endif
+        for (size_t i = 0; i < allocated; i++) {
+            auto &st = r->stacks[i];
+            stack_stats ss;
+            ss.memory = st.memory;
+            ss.reserved = st.size;
+            ss.thread = r->thread;
+            ss.index = i;
+            ss.locked = get(r->in_use[i]);
+            ss.high_water = st.high_water.load(std::memory_order_relaxed);
+            query_stack_memory(snap, st.memory, st.size, ss.resident, ss.committed);
+            gs.stacks.push_back(ss);
+        }
+    }
+    return gs;
+}
+
+
+// Text, appended straight at the end of the buffer. Stacks are large enough
+// that we never need to check for space, as with all other vectors.
+
+// Enough for any integer or shortest round trip float.
+static const size_t MAX_NUMBER_CHARS = 32;
+
+template<typename T> static std::string_view append_number(vector<char> &buf, T t) {
+    auto p = reinterpret_cast<char *>(buf.end);
+    auto res = std::to_chars(p, p + MAX_NUMBER_CHARS, t);
+    assert(res.ec == std::errc());
+    buf.end = reinterpret_cast<uint8_t *>(res.ptr);
+    return { p, static_cast<size_t>(res.ptr - p) };
+}
+
+std::string_view string_builder::append_int(long long i) { return append_number(buf, i); }
+std::string_view string_builder::append_uint(unsigned long long i) { return append_number(buf, i); }
+std::string_view string_builder::append(double d) { return append_number(buf, d); }
+std::string_view string_builder::append(float f) { return append_number(buf, f); }
+
+std::string_view string_builder::format(const char *fmt, ...) {
+    auto p = reinterpret_cast<char *>(buf.end);
+    auto space = static_cast<size_t>(buf.st->memory + buf.st->size - buf.end);
+    va_list args;
+    va_start(args, fmt);
+    auto n = vsnprintf(p, space, fmt, args);
+    va_end(args);
+    if (n < 0) return {};
+    buf.end += n;
+    return { p, static_cast<size_t>(n) };
+}
+
+
+// Sorting.
+
+struct thread_team::state {
+    std::mutex mutex;
+    std::condition_variable start, done;
+    std::vector<std::thread> workers;
+    // Bumped to start each round.
+    size_t round = 0;
+    bool stop = false;
+    void (*task)(void *, size_t) = nullptr;
+    void *ctx = nullptr;
+    size_t tasks = 0;
+    // Tasks are handed out in order to whoever is free.
+    std::atomic<size_t> next { 0 };
+    // Workers still busy with the current round.
+    size_t busy = 0;
+
+    void work() {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < tasks;) task(ctx, i);
+    }
+
+    void worker() {
+        size_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            start.wait(lock, [&]() { return stop || round != seen; });
+            if (stop) return;
+            seen = round;
+            lock.unlock();
+            work();
+            lock.lock();
+            if (!--busy) done.notify_one();
+        }
+    }
+};
+
+thread_team::thread_team(size_t size) : members(size ? size : 1) {
+    if (members == 1) return;
+    s = new state;
+    s->workers.reserve(members - 1);
+    for (size_t i = 1; i < members; i++) s->workers.emplace_back([this]() { s->worker(); });
+}
+
+thread_team::~thread_team() {
+    if (!s) return;
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->stop = true;
+    }
+    s->start.notify_all();
+    for (auto &t : s->workers) t.join();
+    delete s;
+}
+
+void thread_team::run(size_t tasks, void (*task)(void *ctx, size_t i), void *ctx) {
+    if (!s) {
+        for (size_t i = 0; i < tasks; i++) task(ctx, i);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->task = task;
+        s->ctx = ctx;
+        s->tasks = tasks;
+        s->next.store(0, std::memory_order_relaxed);
+        s->busy = s->workers.size();
+        s->round++;
+    }
+    s->start.notify_all();
+    s->work();
+    std::unique_lock<std::mutex> lock(s->mutex);
+    s->done.wait(lock, [&]() { return !s->busy; });
+}
+
+size_t hardware_threads() {
+    static const size_t n = std::max(1u, std::thread::hardware_concurrency());
+    return n;
+}
+
+
+void backoff(unsigned &spins) {
+    if (spins++ < 64) {
+        #if defined(__x86_64__) || defined(_M_X64)
+            _mm_pause();
+        #endif
+    } else {
+        std::this_thread::yield();
+    }
+}
+
+// Reading files straight into a vector.
+
+ptrdiff_t append_from_fd(int fd, basic_vector<uint8_t> &v, size_t max) {
+    auto start = v.end;
+    size_t total = 0;
+    while (total < max) {
+        // Both read() and _read() take at most a couple of GB per call.
+        auto chunk = std::min<size_t>(max - total, 1 << 30);
+        #ifdef _WIN32
+            auto n = _read(fd, v.end, static_cast<unsigned>(chunk));
+        #else
+            auto n = read(fd, v.end, chunk);
+            if (n < 0 && errno == EINTR) continue;
+        #endif
+        if (n < 0) {
+            v.end = start;
+            return -1;
         }
-        if (!stacks[allocated++].alloc(DEFAULT_LARGE_STACK)) {
-            // System doesn't like us allocating this much address space?
-            assert(false);
-            abort();
+        if (n == 0) break;
+        v.end += n;
+        total += n;
+    }
+    return static_cast<ptrdiff_t>(total);
+}
+
+bool read_file(const char *path, basic_vector<uint8_t> &v) {
+    #ifdef _WIN32
+        auto fd = _open(path, _O_RDONLY | _O_BINARY);
+    #else
+        auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    #endif
+    if (fd < 0) return false;
+    auto n = append_from_fd(fd, v);
+    #ifdef _WIN32
+        _close(fd);
+    #else
+        close(fd);
+    #endif
+    return n >= 0;
+}
+
+// Persistent stacks.
+
+#ifndef _WIN32
+
+// Maps all of `fd` shared, after growing it to at least `size` bytes, which
+// for files on disk or in shared memory doesn't write anything.
+// `existing` is the size it had before.
+static uint8_t *map_shared_fd(int fd, size_t size, size_t &mapped, size_t &existing) {
+    struct stat st;
+    if (fstat(fd, &st)) return nullptr;
+    existing = static_cast<size_t>(st.st_size);
+    auto page_size = system_page_size();
+    mapped = std::max((size + page_size - 1) & ~(page_size - 1), existing);
+    if (existing < mapped && ftruncate(fd, static_cast<off_t>(mapped))) return nullptr;
+    auto vp = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    return vp == MAP_FAILED ? nullptr : static_cast<uint8_t *>(vp);
+}
+
+bool persistent_stack::open(const char *path, size_t size) {
+    close();
+    fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    // Check an existing file is one of ours before growing it.
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close();
+        return false;
+    }
+    if (auto file_size = static_cast<size_t>(st.st_size)) {
+        header h;
+        if (file_size < HEADER_SIZE || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+            h.magic != MAGIC || h.version != VERSION || h.used > file_size - HEADER_SIZE) {
+            close();
+            return false;
         }
     }
-    return &stacks[locked++];
+    size_t existing;
+    mapping = map_shared_fd(fd, HEADER_SIZE + size, mapping_size, existing);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    if (!existing) *hdr() = { MAGIC, VERSION, 0 };
+    return true;
+}
+
+void persistent_stack::close() {
+    if (mapping) munmap(mapping, mapping_size);
+    if (fd >= 0) ::close(fd);
+    mapping = nullptr;
+    mapping_size = 0;
+    fd = -1;
+}
+
+bool persistent_stack::sync() {
+    return mapping && !msync(mapping, HEADER_SIZE + hdr()->used, MS_SYNC);
+}
+
+#endif
+
+// Shared memory stacks.
+
+#ifndef _WIN32
+
+bool shared_stack::attach(int _fd, size_t size) {
+    fd = _fd;
+    size_t existing;
+    mapping = map_shared_fd(fd, size, mapping_size, existing);
+    if (!mapping) {
+        close();
+        return false;
+    }
+    if (!existing) {
+        auto h = hdr();
+        h->magic = MAGIC;
+        h->version = VERSION;
+        h->sp = 0;
+        h->published = 0;
+    } else if (existing < HEADER_SIZE || hdr()->magic != MAGIC || hdr()->version != VERSION) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool shared_stack::create(const char *name, size_t size) {
+    close();
+    auto _fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    return _fd >= 0 && attach(_fd, HEADER_SIZE + size);
+}
+
+bool shared_stack::create_anonymous(size_t size) {
+    close();
+    #ifdef __linux__
+        auto _fd = memfd_create("sa::shared_stack", 0);
+        return _fd >= 0 && attach(_fd, HEADER_SIZE + size);
+    #else
+        (void)size;
+        return false;
+    #endif
+}
+
+bool shared_stack::open(const char *name) {
+    close();
+    auto _fd = shm_open(name, O_RDWR, 0);
+    return _fd >= 0 && attach(_fd, 0);
+}
+
+bool shared_stack::attach(int _fd) {
+    close();
+    return attach(_fd, 0);
+}
+
+bool shared_stack::remove(const char *name) {
+    return !shm_unlink(name);
+}
+
+void shared_stack::close() {
+    if (mapping) munmap(mapping, mapping_size);
+    if (fd >= 0) ::close(fd);
+    mapping = nullptr;
+    mapping_size = 0;
+    fd = -1;
+}
+
+#endif
+
+// SIMD kernels for bulk operations on basic_vector.
+// Each has an SSE2 (always available on x64), AVX2 and AVX-512 version,
+// the best of which is picked the first time it is used.
+
+template<typename T> static const T *scalar_find(const T *p, size_t n, T v) {
+    for (size_t i = 0; i < n; i++) if (p[i] == v) return p + i;
+    return nullptr;
 }
 
-void release_stack() {
-    locked--;
+template<typename T> static size_t scalar_count(const T *p, size_t n, T v) {
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++) c += p[i] == v;
+    return c;
 }
 
+// Integer sums wrap, same as the SIMD ones.
+template<typename T, bool = std::is_integral<T>::value> struct wrapping { using type = T; };
+template<typename T> struct wrapping<T, true> { using type = typename std::make_unsigned<T>::type; };
+
+template<typename T> static T scalar_sum(const T *p, size_t n, T acc) {
+    using U = typename wrapping<T>::type;
+    auto sum = static_cast<U>(acc);
+    for (size_t i = 0; i < n; i++) sum += static_cast<U>(p[i]);
+    return static_cast<T>(sum);
+}
+
+template<typename T> static T scalar_min(const T *p, size_t n, T acc) {
+    for (size_t i = 0; i < n; i++) acc = p[i] < acc ? p[i] : acc;
+    return acc;
+}
+
+template<typename T> static T scalar_max(const T *p, size_t n, T acc) {
+    for (size_t i = 0; i < n; i++) acc = p[i] > acc ? p[i] : acc;
+    return acc;
+}
+
+template<typename T> static T scalar_sum(const T *p, size_t n) { return scalar_sum(p, n, T(0)); }
+template<typename T> static T scalar_min(const T *p, size_t n) { return scalar_min(p + 1, n - 1, p[0]); }
+template<typename T> static T scalar_max(const T *p, size_t n) { return scalar_max(p + 1, n - 1, p[0]); }
+
+template<typename T> struct simd_kernels {
+    const T *(*find)(const T *, size_t, T);
+    size_t (*count)(const T *, size_t, T);
+    T (*sum)(const T *, size_t);
+    T (*min)(const T *, size_t);
+    T (*max)(const T *, size_t);
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#ifdef _MSC_VER
+    #define SA_TARGET(t)
+#else
+    #define SA_TARGET(t) __attribute__((target(t)))
+#endif
+
+static int first_bit(unsigned m) {
+    #ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, m);
+        return static_cast<int>(i);
+    #else
+        return __builtin_ctz(m);
+    #endif
+}
+
+// Count kernels accumulate per lane in 32-bit, so they go in blocks that
+// can't overflow that.
+static const size_t COUNT_BLOCK = 1 << 28;
+
+// SSE2.
+
+static const int32_t *find_sse2(const int32_t *p, size_t n, int32_t v) {
+    auto vv = _mm_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), vv);
+        auto m = _mm_movemask_ps(_mm_castsi128_ps(c));
+        if (m) return p + i + first_bit(m);
+    }
+    return scalar_find(p + i, n - i, v);
+}
+
+static const float *find_sse2(const float *p, size_t n, float v) {
+    auto vv = _mm_set1_ps(v);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto m = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(p + i), vv));
+        if (m) return p + i + first_bit(m);
+    }
+    return scalar_find(p + i, n - i, v);
+}
+
+static size_t hsum_sse2(__m128i acc) {
+    alignas(16) uint32_t lanes[4];
+    _mm_store_si128((__m128i *)lanes, acc);
+    return size_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+}
+
+static size_t count_sse2(const int32_t *p, size_t n, int32_t v) {
+    auto vv = _mm_set1_epi32(v);
+    size_t c = 0, i = 0;
+    while (i + 4 <= n) {
+        auto acc = _mm_setzero_si128();
+        auto block_end = i + COUNT_BLOCK < n ? i + COUNT_BLOCK : n;
+        for (; i + 4 <= block_end; i += 4) {
+            // Equal lanes are all ones, i.e. -1.
+            acc = _mm_sub_epi32(acc, _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), vv));
+        }
+        c += hsum_sse2(acc);
+    }
+    return c + scalar_count(p + i, n - i, v);
+}
+
+static size_t count_sse2(const float *p, size_t n, float v) {
+    auto vv = _mm_set1_ps(v);
+    size_t c = 0, i = 0;
+    while (i + 4 <= n) {
+        auto acc = _mm_setzero_si128();
+        auto block_end = i + COUNT_BLOCK < n ? i + COUNT_BLOCK : n;
+        for (; i + 4 <= block_end; i += 4) {
+            acc = _mm_sub_epi32(acc, _mm_castps_si128(_mm_cmpeq_ps(_mm_loadu_ps(p + i), vv)));
+        }
+        c += hsum_sse2(acc);
+    }
+    return c + scalar_count(p + i, n - i, v);
+}
+
+// SSE2 has no 32-bit integer min/max.
+static __m128i min_epi32_sse2(__m128i a, __m128i b) {
+    auto gt = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
+
+static __m128i max_epi32_sse2(__m128i a, __m128i b) {
+    auto gt = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+
+// Generates the reductions, which only differ in the operation and
+// how to combine the lanes at the end.
+#define SA_REDUCE_KERNEL(NAME, TARGET, T, V, W, LOADU, STOREU, INIT, OP, COMBINE) \
+    SA_TARGET(TARGET) static T NAME(const T *p, size_t n) {                       \
+        if (n < W) return scalar_##COMBINE(p, n);                                 \
+        V acc = INIT;                                                             \
+        size_t i = 0;                                                             \
+        for (; i + W <= n; i += W) acc = OP(acc, LOADU(p + i));                   \
+        T lanes[W];                                                               \
+        STOREU(lanes, acc);                                                       \
+        auto r = scalar_##COMBINE(lanes, W);                                      \
+        return scalar_##COMBINE(p + i, n - i, r);                                 \
+    }
+
+#define SA_LOADU_128I(p) _mm_loadu_si128((const __m128i *)(p))
+#define SA_STOREU_128I(p, v) _mm_storeu_si128((__m128i *)(p), v)
+SA_REDUCE_KERNEL(sum_sse2, "sse2", int32_t, __m128i, 4, SA_LOADU_128I, SA_STOREU_128I,
+                 _mm_setzero_si128(), _mm_add_epi32, sum)
+SA_REDUCE_KERNEL(min_sse2, "sse2", int32_t, __m128i, 4, SA_LOADU_128I, SA_STOREU_128I,
+                 SA_LOADU_128I(p), min_epi32_sse2, min)
+SA_REDUCE_KERNEL(max_sse2, "sse2", int32_t, __m128i, 4, SA_LOADU_128I, SA_STOREU_128I,
+                 SA_LOADU_128I(p), max_epi32_sse2, max)
+SA_REDUCE_KERNEL(sum_sse2, "sse2", float, __m128, 4, _mm_loadu_ps, _mm_storeu_ps,
+                 _mm_setzero_ps(), _mm_add_ps, sum)
+SA_REDUCE_KERNEL(min_sse2, "sse2", float, __m128, 4, _mm_loadu_ps, _mm_storeu_ps,
+                 _mm_loadu_ps(p), _mm_min_ps, min)
+SA_REDUCE_KERNEL(max_sse2, "sse2", float, __m128, 4, _mm_loadu_ps, _mm_storeu_ps,
+                 _mm_loadu_ps(p), _mm_max_ps, max)
+
+// AVX2.
+
+SA_TARGET("avx2") static const int32_t *find_avx2(const int32_t *p, size_t n, int32_t v) {
+    auto vv = _mm256_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto c = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p + i)), vv);
+        auto m = _mm256_movemask_ps(_mm256_castsi256_ps(c));
+        if (m) return p + i + first_bit(m);
+    }
+    return scalar_find(p + i, n - i, v);
+}
+
+SA_TARGET("avx2") static const float *find_avx2(const float *p, size_t n, float v) {
+    auto vv = _mm256_set1_ps(v);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto m = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p + i), vv, _CMP_EQ_OQ));
+        if (m) return p + i + first_bit(m);
+    }
+    return scalar_find(p + i, n - i, v);
+}
+
+SA_TARGET("avx2") static size_t hsum_avx2(__m256i acc) {
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256((__m256i *)lanes, acc);
+    size_t c = 0;
+    for (auto l : lanes) c += l;
+    return c;
+}
+
+SA_TARGET("avx2") static size_t count_avx2(const int32_t *p, size_t n, int32_t v) {
+    auto vv = _mm256_set1_epi32(v);
+    size_t c = 0, i = 0;
+    while (i + 8 <= n) {
+        auto acc = _mm256_setzero_si256();
+        auto block_end = i + COUNT_BLOCK < n ? i + COUNT_BLOCK : n;
+        for (; i + 8 <= block_end; i += 8) {
+            auto e = _mm256_loadu_si256((const __m256i *)(p + i));
+            acc = _mm256_sub_epi32(acc, _mm256_cmpeq_epi32(e, vv));
+        }
+        c += hsum_avx2(acc);
+    }
+    return c + scalar_count(p + i, n - i, v);
+}
+
+SA_TARGET("avx2") static size_t count_avx2(const float *p, size_t n, float v) {
+    auto vv = _mm256_set1_ps(v);
+    size_t c = 0, i = 0;
+    while (i + 8 <= n) {
+        auto acc = _mm256_setzero_si256();
+        auto block_end = i + COUNT_BLOCK < n ? i + COUNT_BLOCK : n;
+        for (; i + 8 <= block_end; i += 8) {
+            auto eq = _mm256_cmp_ps(_mm256_loadu_ps(p + i), vv, _CMP_EQ_OQ);
+            acc = _mm256_sub_epi32(acc, _mm256_castps_si256(eq));
+        }
+        c += hsum_avx2(acc);
+    }
+    return c + scalar_count(p + i, n - i, v);
+}
+
+#define SA_LOADU_256I(p) _mm256_loadu_si256((const __m256i *)(p))
+#define SA_STOREU_256I(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+SA_REDUCE_KERNEL(sum_avx2, "avx2", int32_t, __m256i, 8, SA_LOADU_256I, SA_STOREU_256I,
+                 _mm256_setzero_si256(), _mm256_add_epi32, sum)
+SA_REDUCE_KERNEL(min_avx2, "avx2", int32_t, __m256i, 8, SA_LOADU_256I, SA_STOREU_256I,
+                 SA_LOADU_256I(p), _mm256_min_epi32, min)
+SA_REDUCE_KERNEL(max_avx2, "avx2", int32_t, __m256i, 8, SA_LOADU_256I, SA_STOREU_256I,
+                 SA_LOADU_256I(p), _mm256_max_epi32, max)
+SA_REDUCE_KERNEL(sum_avx2, "avx2", float, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps,
+                 _mm256_setzero_ps(), _mm256_add_ps, sum)
+SA_REDUCE_KERNEL(min_avx2, "avx2", float, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps,
+                 _mm256_loadu_ps(p), _mm256_min_ps, min)
+SA_REDUCE_KERNEL(max_avx2, "avx2", float, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps,
+                 _mm256_loadu_ps(p), _mm256_max_ps, max)
+
+// AVX-512, where comparisons produce bit masks directly.
+
+SA_TARGET("avx512f") static const int32_t *find_avx512(const int32_t *p, size_t n, int32_t v) {
+    auto vv = _mm512_set1_epi32(v);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto m = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(p + i), vv);
+        if (m) return p + i + first_bit(m);
+    }
+    return scalar_find(p + i, n - i, v);
+}
+
+SA_TARGET("avx512f") static const float *find_avx512(const float *p, size_t n, float v) {
+    auto vv = _mm512_set1_ps(v);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto m = _mm512_cmp_ps_mask(_mm512_loadu_ps(p + i), vv, _CMP_EQ_OQ);
+        if (m) return p + i + first_bit(m);
+    }
+    return scalar_find(p + i, n - i, v);
+}
+
+// GCC's _mm512_reduce_add_epi32 and unmasked min/max start from an
+// _mm512_undefined_*() value, which -Wmaybe-uninitialized flags (falsely).
+// So reduce thru a lane store like hsum_avx2, and use masked min/max with
+// all lanes selected.
+SA_TARGET("avx512f") static size_t hsum_avx512(__m512i acc) {
+    alignas(64) uint32_t lanes[16];
+    _mm512_store_si512(lanes, acc);
+    size_t c = 0;
+    for (auto l : lanes) c += l;
+    return c;
+}
+
+SA_TARGET("avx512f") static __m512i min_epi32_avx512(__m512i a, __m512i b) {
+    return _mm512_mask_min_epi32(a, 0xFFFF, a, b);
+}
+
+SA_TARGET("avx512f") static __m512i max_epi32_avx512(__m512i a, __m512i b) {
+    return _mm512_mask_max_epi32(a, 0xFFFF, a, b);
+}
+
+SA_TARGET("avx512f") static __m512 min_ps_avx512(__m512 a, __m512 b) {
+    return _mm512_mask_min_ps(a, 0xFFFF, a, b);
+}
+
+SA_TARGET("avx512f") static __m512 max_ps_avx512(__m512 a, __m512 b) {
+    return _mm512_mask_max_ps(a, 0xFFFF, a, b);
+}
+
+SA_TARGET("avx512f") static size_t count_avx512(const int32_t *p, size_t n, int32_t v) {
+    auto vv = _mm512_set1_epi32(v);
+    auto ones = _mm512_set1_epi32(1);
+    size_t c = 0, i = 0;
+    while (i + 16 <= n) {
+        auto acc = _mm512_setzero_si512();
+        auto block_end = i + COUNT_BLOCK < n ? i + COUNT_BLOCK : n;
+        for (; i + 16 <= block_end; i += 16) {
+            auto m = _mm512_cmpeq_epi32_mask(_mm512_loadu_si512(p + i), vv);
+            acc = _mm512_mask_add_epi32(acc, m, acc, ones);
+        }
+        c += hsum_avx512(acc);
+    }
+    return c + scalar_count(p + i, n - i, v);
+}
+
+SA_TARGET("avx512f") static size_t count_avx512(const float *p, size_t n, float v) {
+    auto vv = _mm512_set1_ps(v);
+    auto ones = _mm512_set1_epi32(1);
+    size_t c = 0, i = 0;
+    while (i + 16 <= n) {
+        auto acc = _mm512_setzero_si512();
+        auto block_end = i + COUNT_BLOCK < n ? i + COUNT_BLOCK : n;
+        for (; i + 16 <= block_end; i += 16) {
+            auto m = _mm512_cmp_ps_mask(_mm512_loadu_ps(p + i), vv, _CMP_EQ_OQ);
+            acc = _mm512_mask_add_epi32(acc, m, acc, ones);
+        }
+        c += hsum_avx512(acc);
+    }
+    return c + scalar_count(p + i, n - i, v);
+}
+
+#define SA_LOADU_512(p) _mm512_loadu_si512(p)
+#define SA_STOREU_512(p, v) _mm512_storeu_si512(p, v)
+SA_REDUCE_KERNEL(sum_avx512, "avx512f", int32_t, __m512i, 16, SA_LOADU_512, SA_STOREU_512,
+                 _mm512_setzero_si512(), _mm512_add_epi32, sum)
+SA_REDUCE_KERNEL(min_avx512, "avx512f", int32_t, __m512i, 16, SA_LOADU_512, SA_STOREU_512,
+                 SA_LOADU_512(p), min_epi32_avx512, min)
+SA_REDUCE_KERNEL(max_avx512, "avx512f", int32_t, __m512i, 16, SA_LOADU_512, SA_STOREU_512,
+                 SA_LOADU_512(p), max_epi32_avx512, max)
+SA_REDUCE_KERNEL(sum_avx512, "avx512f", float, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+                 _mm512_setzero_ps(), _mm512_add_ps, sum)
+SA_REDUCE_KERNEL(min_avx512, "avx512f", float, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+                 _mm512_loadu_ps(p), min_ps_avx512, min)
+SA_REDUCE_KERNEL(max_avx512, "avx512f", float, __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps,
+                 _mm512_loadu_ps(p), max_ps_avx512, max)
+
+enum class simd_level { sse2, avx2, avx512 };
+
+static simd_level detect_simd_level() {
+    #ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return simd_level::sse2;
+        __cpuid(info, 1);
+        // The OS must also save the wider registers on context switches.
+        if (!(info[2] & (1 << 27))) return simd_level::sse2;
+        auto xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        if ((info[1] & (1 << 16)) && (xcr0 & 0xE6) == 0xE6) return simd_level::avx512;
+        if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6) return simd_level::avx2;
+        return simd_level::sse2;
+    #else
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+        if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+        return simd_level::sse2;
+    #endif
+}
+
+template<typename T> static simd_kernels<T> pick_kernels() {
+    switch (detect_simd_level()) {
+        case simd_level::avx512:
+            return { find_avx512, count_avx512, sum_avx512, min_avx512, max_avx512 };
+        case simd_level::avx2:
+            return { find_avx2, count_avx2, sum_avx2, min_avx2, max_avx2 };
+        default:
+            return { find_sse2, count_sse2, sum_sse2, min_sse2, max_sse2 };
+    }
+}
+
+#else
+
+template<typename T> static simd_kernels<T> pick_kernels() {
+    return { scalar_find<T>, scalar_count<T>, scalar_sum<T>, scalar_min<T>, scalar_max<T> };
+}
+
+#endif
+
+template<typename T> static const simd_kernels<T> &kernels() {
+    static const simd_kernels<T> k = pick_kernels<T>();
+    return k;
+}
+
+const int32_t *simd_find(const int32_t *p, size_t n, int32_t v) { return kernels<int32_t>().find(p, n, v); }
+const float *simd_find(const float *p, size_t n, float v) { return kernels<float>().find(p, n, v); }
+size_t simd_count(const int32_t *p, size_t n, int32_t v) { return kernels<int32_t>().count(p, n, v); }
+size_t simd_count(const float *p, size_t n, float v) { return kernels<float>().count(p, n, v); }
+int32_t simd_sum(const int32_t *p, size_t n) { return kernels<int32_t>().sum(p, n); }
+float simd_sum(const float *p, size_t n) { return kernels<float>().sum(p, n); }
+int32_t simd_min(const int32_t *p, size_t n) { return kernels<int32_t>().min(p, n); }
+float simd_min(const float *p, size_t n) { return kernels<float>().min(p, n); }
+int32_t simd_max(const int32_t *p, size_t n) { return kernels<int32_t>().max(p, n); }
+float simd_max(const float *p, size_t n) { return kernels<float>().max(p, n); }
+
 }  // namespace sa
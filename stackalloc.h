@@ -12,9 +12,39 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <cassert>
+#include <functional>
+#include <iterator>
+#include <memory_resource>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Debug mode: puts an inaccessible page right after the capacity of every
+// vector_max, such that overflowing one crashes at the faulting instruction
+// (with a diagnostic on stderr) instead of corrupting its neighbour.
+// Costs a couple of system calls and at least a page per vector_max.
+// Overflowing a stack as a whole is always caught this way (on Linux).
+#ifndef SA_DEBUG_GUARDS
+    #define SA_DEBUG_GUARDS 0
+#endif
+
+// Keeps counts of stack usage for stats(). Off by default in release builds,
+// where it would cost a few extra loads and stores per vector.
+#ifndef SA_STATS
+    #ifdef NDEBUG
+        #define SA_STATS 0
+    #else
+        #define SA_STATS 1
+    #endif
+#endif
 
 /*
 
@@ -29,24 +59,106 @@ get from using std::vector, except with:
 
 namespace sa {
 
+// How the memory of a stack is backed. Huge pages mean far fewer page faults
+// while a stack fills up, and far fewer TLB misses when accessing it randomly.
+enum class page_mode {
+    normal,
+    // Ask the OS to back the stack with huge pages when it can (Linux THP).
+    transparent_huge,
+    // Explicit huge pages (Linux MAP_HUGETLB). These get reserved up front,
+    // so the whole stack must fit in the system's huge page pool. Falls
+    // back to transparent_huge if it doesn't.
+    explicit_huge,
+};
+
 // Low level functions implementing platform specific ways to obtain
 // large chunks of growable address space.
 
-uint8_t *alloc_stack_address_space(size_t size);
+// `mode` is updated to what the system actually gave us. `index` is the
+// stack's index in its thread's set, for overflow diagnostics.
+uint8_t *alloc_stack_address_space(size_t size, page_mode &mode, size_t index = SIZE_MAX);
 void dealloc_stack_address_space(uint8_t *mem, size_t size);
+// Gives the physical memory behind this range back to the OS, but keeps the
+// address space reserved. The start is rounded up to a page boundary.
+void reclaim_stack_address_space(uint8_t *mem, size_t size, bool lazy);
+
+// Also useful as alignment for vector_max etc.
+size_t system_page_size();
+const size_t cache_line_size = 64;
+
+// Used by SA_DEBUG_GUARDS.
+struct stack;
+void protect_guard_page(stack *st, uint8_t *page);
+void unprotect_guard_page(uint8_t *page);
+
+// By default, any page a stack ever touched stays resident for the lifetime
+// of the stack, which is the fastest option if usage is fairly constant.
+// If a stack occasionally spikes, this allows the excess to be given back.
+struct reclaim_policy {
+    bool enabled = false;
+    // The first this many bytes of a stack are never given back.
+    // Reclaiming only happens once sp is below this point.
+    size_t keep_resident = 64 * 1024 * 1024;
+    // Only reclaim once at least this many bytes beyond keep_resident
+    // have been used, such that vectors going back and forth around the
+    // threshold don't call into the OS every time.
+    size_t hysteresis = 16 * 1024 * 1024;
+    // Use MADV_FREE (where available), which is cheaper, but the pages
+    // only disappear from RSS once the OS needs them.
+    bool lazy = false;
+};
 
 struct stack {
     uint8_t *sp = nullptr;
     uint8_t *memory = nullptr;
     size_t size = 0;
+    // Furthest point we know has been used since the last reclaim.
+    uint8_t *dirty = nullptr;
+    reclaim_policy reclaim;
+    page_mode pages = page_mode::normal;
+    // SA_STATS: furthest point ever used, relative to memory. Atomic only so
+    // stats() can read it from other threads. Present either way, so the
+    // layout doesn't depend on SA_STATS (which may differ per translation
+    // unit, e.g. a release build of the library in a debug app).
+    std::atomic<size_t> high_water { 0 };
 
     stack() {}
 
-    bool alloc(size_t _size) {
-        sp = memory = alloc_stack_address_space(size = _size);
+    bool alloc(size_t _size, page_mode mode = page_mode::normal, size_t index = SIZE_MAX) {
+        if (mode != page_mode::normal) {
+            // Keep the size a multiple of the (2MB) huge page size.
+            const size_t huge_page = 1 << 21;
+            _size = (_size + huge_page - 1) & ~(huge_page - 1);
+        }
+        pages = mode;
+        sp = memory = dirty = alloc_stack_address_space(size = _size, pages, index);
         return memory != nullptr;
     }
 
+    // Called whenever memory above sp stops being used, with the furthest
+    // point it was used up to. Only the owner of a locked stack may reclaim:
+    // containers that don't lock theirs (vector_max, vector_fixed) may go
+    // away while another container is using memory above them.
+    void unwound(uint8_t *used, bool may_reclaim = true) {
+        if (used > dirty) dirty = used;
+        #if SA_STATS
+            auto extent = static_cast<size_t>(used - memory);
+            if (extent > high_water.load(std::memory_order_relaxed)) {
+                high_water.store(extent, std::memory_order_relaxed);
+            }
+        #endif
+        if (reclaim.enabled && may_reclaim) maybe_reclaim();
+    }
+
+    void maybe_reclaim() {
+        auto threshold = memory + reclaim.keep_resident;
+        if (sp <= threshold && dirty > threshold &&
+            static_cast<size_t>(dirty - threshold) >= reclaim.hysteresis) {
+            reclaim_stack_address_space(threshold, dirty - threshold, reclaim.lazy);
+            dirty = threshold;
+        }
+    }
+
     ~stack() {
         if (memory) {
             dealloc_stack_address_space(memory, size);
@@ -58,6 +170,37 @@ struct stack {
     stack &operator=(const stack &) = delete;
 };
 
+// SIMD kernels used by the bulk operations of basic_vector below, picked
+// at runtime for the best instruction set available (AVX-512, AVX2 or SSE2).
+// Float sums are computed in a different order than a simple loop would.
+const int32_t *simd_find(const int32_t *p, size_t n, int32_t v);
+const float *simd_find(const float *p, size_t n, float v);
+size_t simd_count(const int32_t *p, size_t n, int32_t v);
+size_t simd_count(const float *p, size_t n, float v);
+int32_t simd_sum(const int32_t *p, size_t n);
+float simd_sum(const float *p, size_t n);
+int32_t simd_min(const int32_t *p, size_t n);
+float simd_min(const float *p, size_t n);
+int32_t simd_max(const int32_t *p, size_t n);
+float simd_max(const float *p, size_t n);
+
+template<typename T> constexpr bool has_simd_kernels =
+    std::is_same<T, int32_t>::value || std::is_same<T, float>::value;
+
+// Alignment of a vector's storage, e.g. sa::alignment{cache_line_size}.
+// A type of its own, such that it can't be mistaken for an element count.
+// Must be a power of 2, at least alignof the element type.
+struct alignment {
+    size_t bytes;
+
+    explicit constexpr alignment(size_t _bytes) : bytes(_bytes) {}
+};
+
+inline uint8_t *align_up(uint8_t *p, size_t align) {
+    return reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(p) + align - 1) &
+                                       ~(static_cast<uintptr_t>(align) - 1));
+}
+
 // This "basic" version needs to be explictly supplied a stack to allocate
 // on, which may be useful when more control/speed is required.
 template<typename T>
@@ -68,20 +211,52 @@ struct basic_vector {
     // No allocation!
     basic_vector(uint8_t *sp) : end(sp), begin(sp) {}
 
-    // No de-allocation!
+    // Copies would destruct the same elements twice.
+    basic_vector(const basic_vector &) = delete;
+    basic_vector &operator=(const basic_vector &) = delete;
+
+    // No de-allocation! Only runs destructors, if T has any.
     ~basic_vector() {
+        clear();
     }
 
     // No (re) allocation, no capacity check.
     void push_back(const T &t) {
-        // FIXME: avoid copy / construct in place?
-        memcpy(end, &t, sizeof(T));
+        assert(end && "pushing to a moved-from vector");
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            memcpy(end, &t, sizeof(T));
+        } else {
+            new (end) T(t);
+        }
         end += sizeof(T);
     }
 
+    void push_back(T &&t) {
+        assert(end && "pushing to a moved-from vector");
+        new (end) T(std::move(t));
+        end += sizeof(T);
+    }
+
+    template<typename... Args> T &emplace_back(Args &&... args) {
+        assert(end && "pushing to a moved-from vector");
+        auto t = new (end) T(std::forward<Args>(args)...);
+        end += sizeof(T);
+        return *t;
+    }
+
     void pop_back() {
         assert(end > begin);
         end -= sizeof(T);
+        if constexpr (!std::is_trivially_destructible<T>::value) {
+            reinterpret_cast<T *>(end)->~T();
+        }
+    }
+
+    void clear() {
+        if constexpr (!std::is_trivially_destructible<T>::value) {
+            while (end > begin) pop_back();
+        }
+        end = begin;
     }
 
     T &operator[](size_t i) {
@@ -94,84 +269,894 @@ struct basic_vector {
         return *(reinterpret_cast<T *>(end) - 1);
     }
 
+    // The element stays valid until overwritten, so this only makes sense
+    // for types without destructors. Use back() + pop_back() otherwise.
     T &pop() {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "pop() would return a destructed element");
         assert(end > begin);
         end -= sizeof(T);
         return *(reinterpret_cast<T *>(end));
     }
 
-    size_t size() { return (begin - end) / sizeof(T); }
+    size_t size() { return (end - begin) / sizeof(T); }
 
     void push_multiple(const T *elems, size_t size) {
-        memcpy(end, elems, size * sizeof(T));
-        end += size * sizeof(T);
+        assert(end && "pushing to a moved-from vector");
+        if constexpr (std::is_trivially_copyable<T>::value) {
+            memcpy(end, elems, size * sizeof(T));
+            end += size * sizeof(T);
+        } else {
+            for (size_t i = 0; i < size; i++) push_back(elems[i]);
+        }
+    }
+
+    T *data() { return reinterpret_cast<T *>(begin); }
+
+    // Bulk operations. These are a lot faster than going thru operator[]
+    // for int and float, which use SIMD kernels.
+
+    void append_range(const T *first, const T *last) {
+        push_multiple(first, last - first);
+    }
+
+    void fill(const T &t) {
+        // Simple enough for compilers to vectorize on their own.
+        auto p = data();
+        for (size_t i = 0, n = size(); i < n; i++) p[i] = t;
+    }
+
+    // Replaces every element `e` by `f(e)`.
+    template<typename F> void transform(F f) {
+        auto p = data();
+        for (size_t i = 0, n = size(); i < n; i++) p[i] = f(p[i]);
+    }
+
+    // Returns nullptr if not found.
+    T *find(const T &t) {
+        if constexpr (has_simd_kernels<T>) {
+            return const_cast<T *>(simd_find(data(), size(), t));
+        } else {
+            for (auto p = data(), e = p + size(); p != e; ++p) if (*p == t) return p;
+            return nullptr;
+        }
+    }
+
+    size_t count(const T &t) {
+        if constexpr (has_simd_kernels<T>) {
+            return simd_count(data(), size(), t);
+        } else {
+            size_t c = 0;
+            for (auto p = data(), e = p + size(); p != e; ++p) c += *p == t;
+            return c;
+        }
+    }
+
+    T sum() {
+        static_assert(std::is_arithmetic<T>::value, "sum() needs a numeric type");
+        if constexpr (has_simd_kernels<T>) {
+            return simd_sum(data(), size());
+        } else {
+            T acc = 0;
+            for (auto p = data(), e = p + size(); p != e; ++p) acc += *p;
+            return acc;
+        }
+    }
+
+    T min() {
+        static_assert(std::is_arithmetic<T>::value, "min() needs a numeric type");
+        assert(end > begin);
+        if constexpr (has_simd_kernels<T>) {
+            return simd_min(data(), size());
+        } else {
+            auto acc = *data();
+            for (auto p = data(), e = p + size(); p != e; ++p) acc = *p < acc ? *p : acc;
+            return acc;
+        }
+    }
+
+    T max() {
+        static_assert(std::is_arithmetic<T>::value, "max() needs a numeric type");
+        assert(end > begin);
+        if constexpr (has_simd_kernels<T>) {
+            return simd_max(data(), size());
+        } else {
+            auto acc = *data();
+            for (auto p = data(), e = p + size(); p != e; ++p) acc = *p > acc ? *p : acc;
+            return acc;
+        }
     }
 };
 
 
+// Stacks are managed per thread: each thread has its own set of stacks,
+// so these need no synchronization, but must be called on the thread that
+// uses them. Stacks can be released in any order, so containers holding one
+// can live in long-lived structures rather than just in scopes.
 stack *acquire_stack();
-void release_stack();
+void release_stack(stack *st);
+
+// Process wide settings for automatically managed stacks.
+// Each of the sizes can be overridden by an environment variable of the
+// same name in upper case with an SA_ prefix (e.g. SA_STACK_SIZE=1G), for
+// hosts with limited address space (strict ulimit -v, overcommit_memory=2).
+struct config {
+    // Address space reserved per stack: 64GB? Why not?
+    size_t stack_size = 1ULL << 36;
+    // If the system refuses to reserve stack_size, it is halved until it
+    // works, or this size is reached.
+    size_t min_stack_size = 1ULL << 24;
+    // Max stacks a thread can have in use at once.
+    size_t max_stacks_per_thread = 1ULL << 10;
+    // Max stacks in use across all threads, 0 for unlimited.
+    size_t max_stacks = 0;
+    // Defaults for new threads, see set_reclaim_policy / set_page_mode.
+    reclaim_policy reclaim;
+    page_mode pages = page_mode::normal;
+};
+
+// Call before any stacks are used: threads that already have stacks keep
+// using the settings they started with. If never called, the defaults above
+// are used (still overridable by the environment).
+void init(const config &cfg);
+config current_config();
+
+// Sets the reclaim policy for all current and future stacks of this thread.
+void set_reclaim_policy(const reclaim_policy &policy);
+// Sets how future stacks of this thread are backed.
+void set_page_mode(page_mode mode);
+
+// Usage statistics across all threads, e.g. for exporting to a metrics
+// system. Fields marked SA_STATS are 0 unless compiled with that on.
+// Memory usage is always measured over the whole reservation, so includes
+// containers that are still alive.
+struct stack_stats {
+    uint8_t *memory = nullptr;
+    size_t reserved = 0;
+    long thread = 0;
+    // Index in the thread's set of stacks.
+    size_t index = 0;
+    bool locked = false;
+    // SA_STATS: furthest point ever used.
+    size_t high_water = 0;
+    size_t resident = 0;
+    size_t committed = 0;
+};
+
+struct global_stats {
+    size_t reserved_stacks = 0;
+    size_t locked_stacks = 0;
+    // SA_STATS: acquire_stack() / release_stack() calls, and the most
+    // stacks any thread had locked at once.
+    size_t acquires = 0;
+    size_t releases = 0;
+    size_t peak_locked = 0;
+    std::vector<stack_stats> stacks;
+};
+
+global_stats stats();
 
 // This one automatically acquires a stack and holds on to it for its lifetime.
 // This is for cases where the max size is not known, or very variable.
 // Most users want to be using this one by default.
 template<typename T>
 struct vector : basic_vector<T> {
-    vector() : basic_vector<T>(acquire_stack()->sp) {}
-    ~vector() { release_stack(); }
+    stack *st;
+
+    vector() : vector(alignment(alignof(T))) {}
+
+    explicit vector(alignment align) : basic_vector<T>(nullptr), st(acquire_stack()) {
+        assert(align.bytes >= alignof(T) && !(align.bytes & (align.bytes - 1)));
+        this->begin = this->end = align_up(st->sp, align.bytes);
+    }
+
+    ~vector() {
+        release();
+    }
+
+    // Moving hands over the stack, so elements stay where they are (and
+    // pointers to them stay valid). The moved-from vector is left without a
+    // stack, so may only be destroyed or assigned to, not pushed to.
+    vector(vector &&o) noexcept : basic_vector<T>(nullptr), st(nullptr) {
+        take(o);
+    }
+
+    vector &operator=(vector &&o) noexcept {
+        if (this != &o) {
+            release();
+            take(o);
+        }
+        return *this;
+    }
+
+    // Copies would share a stack, use clone() instead.
+    vector(const vector &) = delete;
+    vector &operator=(const vector &) = delete;
+
+    // A copy of all elements on a stack of its own.
+    vector clone(alignment align = alignment(alignof(T))) const {
+        vector v(align);
+        v.push_multiple(reinterpret_cast<const T *>(this->begin),
+                        (this->end - this->begin) / sizeof(T));
+        return v;
+    }
+
+  private:
+    void release() {
+        if (!st) return;
+        // Note: this doesn't see elements that were popped before we got
+        // here, so those pages may stay resident until the next reclaim.
+        auto used = this->end;
+        // Destruct elements before their memory is potentially reclaimed.
+        this->clear();
+        st->unwound(used);
+        release_stack(st);
+        st = nullptr;
+    }
+
+    void take(vector &o) {
+        st = o.st;
+        this->begin = o.begin;
+        this->end = o.end;
+        o.st = nullptr;
+        o.begin = o.end = nullptr;
+    }
 };
 
 
 // This one has a fixed capacity, so does NOT hold on to a stack,
-// and thus can share stack storage with others.
+// and thus can share stack storage with others. Since it carves its space
+// out of whatever stack is free, these must still be destroyed in LIFO order
+// relative to each other, unlike other vectors.
 template<typename T>
 struct vector_max : basic_vector<T> {
     stack *st;
     uint8_t *capacity;
+    // Where sp was before us, since begin may have been aligned up from it.
+    uint8_t *base;
+
+    // Use e.g. alignment{cache_line_size} to avoid false sharing with
+    // neighbouring data.
+    #if SA_DEBUG_GUARDS
+        uint8_t *guard;
 
-    vector_max(size_t max)
-        : basic_vector<T>(nullptr), st(acquire_stack()), capacity(st->sp + max * sizeof(T)) {
-        this->begin = this->end = st->sp;  // FIXME: do not repeat this?
-        st->sp += max * sizeof(T);
-        release_stack();
+        vector_max(size_t max, alignment _align = alignment(alignof(T)))
+            : basic_vector<T>(nullptr), st(acquire_stack()), base(st->sp) {
+            auto align = _align.bytes;
+            assert(align >= alignof(T) && !(align & (align - 1)));
+            // Place the buffer such that it ends as close to the guard page
+            // as alignment allows.
+            auto page = system_page_size();
+            auto bytes = max * sizeof(T);
+            guard = align_up(align_up(st->sp, align) + bytes, page > align ? page : align);
+            this->begin = this->end = guard - ((bytes + align - 1) & ~(align - 1));
+            capacity = this->begin + bytes;
+            protect_guard_page(st, guard);
+            st->sp = guard + page;
+            release_stack(st);
+        }
+
+        ~vector_max() {
+            this->clear();
+            unprotect_guard_page(guard);
+            st->sp = base;
+            st->unwound(guard + system_page_size(), false);
+        }
+    #else
+        vector_max(size_t max, alignment align = alignment(alignof(T)))
+            : basic_vector<T>(nullptr), st(acquire_stack()), base(st->sp) {
+            assert(align.bytes >= alignof(T) && !(align.bytes & (align.bytes - 1)));
+            this->begin = this->end = align_up(st->sp, align.bytes);
+            st->sp = capacity = this->begin + max * sizeof(T);
+            release_stack(st);
+        }
+
+        ~vector_max() {
+            this->clear();
+            st->sp = base;
+            st->unwound(capacity, false);
+        }
+    #endif
+
+    // Copies would unwind the stack twice.
+    vector_max(const vector_max &) = delete;
+    vector_max &operator=(const vector_max &) = delete;
+
+    void push_back(const T &t) {
+        assert(this->end < capacity);
+        basic_vector<T>::push_back(t);
     }
 
-    ~vector_max() {
-        st->sp = this->begin;
+    void push_back(T &&t) {
+        assert(this->end < capacity);
+        basic_vector<T>::push_back(std::move(t));
     }
 
-    void push_back(const T &t) {
+    template<typename... Args> T &emplace_back(Args &&... args) {
         assert(this->end < capacity);
-        memcpy(this->end, &t, sizeof(T));
-        this->end += sizeof(T);
+        return basic_vector<T>::emplace_back(std::forward<Args>(args)...);
+    }
+};
+
+
+// Allocates arbitrary objects and arrays, which are all freed at once when
+// the scope ends, in O(1) (unless they have destructors, which are run in
+// reverse order). Like a function call stack, but for heap-like objects.
+// Locks a stack for its lifetime, so any vectors created while it is alive
+// will use other stacks.
+struct scope {
+    stack *st;
+    uint8_t *mark;
+
+    // Only objects with non-trivial destructors get one of these in front.
+    struct cleanup {
+        cleanup *next;
+        void (*destroy)(void *, size_t);
+        void *objs;
+        size_t count;
+    };
+    cleanup *cleanups = nullptr;
+
+    scope() : st(acquire_stack()), mark(st->sp) {}
+
+    ~scope() {
+        rewind();
+        release_stack(st);
+    }
+
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+    // No initialization, no capacity check.
+    void *alloc_bytes(size_t size, size_t align = alignof(std::max_align_t)) {
+        auto p = align_up(st->sp, align);
+        st->sp = p + size;
+        return p;
+    }
+
+    template<typename T, typename... Args> T *alloc(Args &&... args) {
+        return alloc_objects<T>(1, std::forward<Args>(args)...);
+    }
+
+    // Elements are value-initialized, i.e. zeroed for scalar types.
+    template<typename T> T *alloc_array(size_t count) {
+        return alloc_objects<T>(count);
+    }
+
+    // Frees everything allocated so far, so the scope can be reused, e.g.
+    // once per request.
+    void rewind() {
+        for (auto c = cleanups; c; c = c->next) c->destroy(c->objs, c->count);
+        cleanups = nullptr;
+        auto used = st->sp;
+        st->sp = mark;
+        st->unwound(used);
+    }
+
+  private:
+    template<typename T, typename... Args> T *alloc_objects(size_t count, Args &&... args) {
+        if constexpr (std::is_trivially_destructible<T>::value) {
+            auto objs = static_cast<T *>(alloc_bytes(count * sizeof(T), alignof(T)));
+            for (size_t i = 0; i < count; i++) new (objs + i) T(std::forward<Args>(args)...);
+            return objs;
+        } else {
+            auto c = static_cast<cleanup *>(alloc_bytes(sizeof(cleanup), alignof(cleanup)));
+            auto objs = static_cast<T *>(alloc_bytes(count * sizeof(T), alignof(T)));
+            size_t i = 0;
+            try {
+                for (; i < count; i++) new (objs + i) T(std::forward<Args>(args)...);
+            } catch (...) {
+                destroy_objects<T>(objs, i);
+                throw;
+            }
+            // Only link once fully constructed, so we never destroy a
+            // partially constructed array.
+            *c = { cleanups, destroy_objects<T>, objs, count };
+            cleanups = c;
+            return objs;
+        }
+    }
+
+    template<typename T> static void destroy_objects(void *objs, size_t count) {
+        while (count) static_cast<T *>(objs)[--count].~T();
+    }
+};
+
+
+// Lets existing std::pmr containers allocate from a stack: allocation is
+// a pointer bump, deallocation does nothing, and everything is freed at once
+// when this goes out of scope (or on release()).
+// Like scope, this locks a stack for its lifetime.
+struct stack_resource : std::pmr::memory_resource {
+    scope frame;
+
+    void release() { frame.rewind(); }
+
+  protected:
+    void *do_allocate(size_t bytes, size_t align) override {
+        return frame.alloc_bytes(bytes, align);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
     }
 };
 
 
 // This one is fixed at creation time. Useful for strings and such.
-// Also doesn't hold on to a stack.
-// FIXME: probably shouldn't inherit because we don't want to allow push/pop.
+// Also doesn't hold on to a stack: like vector_max, it takes its space
+// from whatever stack is free, so must be destroyed in LIFO order relative
+// to other vector_fixed and vector_max. Immutable once built.
 template<typename T>
-struct vector_fixed : basic_vector<T> {
+struct vector_fixed {
+    static_assert(std::is_trivially_copyable<T>::value, "contents are copied as bytes");
+
     stack *st;
+    // Where sp was before us, since elems may have been aligned up from it.
+    uint8_t *base;
+    const T *elems;
+    size_t len;
+
+    // Copies `len` elements from `t` onto `st`.
+    vector_fixed(stack *_st, const T *t, size_t _len) : st(_st), base(st->sp), len(_len) {
+        auto p = align_up(st->sp, alignof(T));
+        memcpy(p, t, len * sizeof(T));
+        st->sp = p + len * sizeof(T);
+        elems = reinterpret_cast<const T *>(p);
+    }
 
-    vector_fixed(stack *st, T *t, size_t len) : basic_vector<T>(st), st(st) {
-        memcpy(begin, t, len * sizeof(T));
-        st->sp = this->end = begin + len * sizeof(T);
+    vector_fixed(const T *t, size_t _len) : vector_fixed(acquire_stack(), t, _len) {
+        release_stack(st);
     }
 
+    // Strings. Explicit, since each of these takes stack space.
+    template<typename U = T, typename = std::enable_if_t<std::is_same<U, char>::value>>
+    explicit vector_fixed(std::string_view str) : vector_fixed(str.data(), str.size()) {}
+    template<typename U = T, typename = std::enable_if_t<std::is_same<U, char>::value>>
+    explicit vector_fixed(const char *str) : vector_fixed(std::string_view(str)) {}
+
     ~vector_fixed() {
-        st->sp = this->begin();
+        st->sp = base;
+        st->unwound(reinterpret_cast<uint8_t *>(const_cast<T *>(elems + len)), false);
+    }
+
+    vector_fixed(const vector_fixed &) = delete;
+    vector_fixed &operator=(const vector_fixed &) = delete;
+
+    size_t size() const { return len; }
+    bool empty() const { return !len; }
+    const T *data() const { return elems; }
+    const T *begin() const { return elems; }
+    const T *end() const { return elems + len; }
+    const T &operator[](size_t i) const {
+        assert(i < len);
+        return elems[i];
+    }
+
+    template<typename U = T, typename = std::enable_if_t<std::is_same<U, char>::value>>
+    operator std::string_view() const { return { elems, len }; }
+
+    friend bool operator==(const vector_fixed &a, const vector_fixed &b) {
+        return a.len == b.len && std::equal(a.begin(), a.end(), b.begin());
+    }
+    friend bool operator!=(const vector_fixed &a, const vector_fixed &b) { return !(a == b); }
+    friend bool operator<(const vector_fixed &a, const vector_fixed &b) {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+
+    // Compare to strings without needing to put them on a stack first.
+    friend bool operator==(const vector_fixed &a, std::string_view b) {
+        return std::string_view(a) == b;
+    }
+    friend bool operator!=(const vector_fixed &a, std::string_view b) { return !(a == b); }
+};
+
+using fixed_string = vector_fixed<char>;
+
+// Builds text straight at the end of a vector<char>, so it never reallocates,
+// and views of pieces appended earlier (as returned by each append) stay
+// valid while more gets appended.
+struct string_builder {
+    vector<char> buf;
+
+    std::string_view append(std::string_view str) {
+        auto p = buf.end;
+        buf.push_multiple(str.data(), str.size());
+        return { reinterpret_cast<char *>(p), str.size() };
+    }
+    std::string_view append(const char *str) { return append(std::string_view(str)); }
+    std::string_view append(char c) { return append(std::string_view(&c, 1)); }
+
+    // Integers in decimal.
+    template<typename I, typename = std::enable_if_t<std::is_integral<I>::value &&
+                                                     !std::is_same<I, char>::value &&
+                                                     !std::is_same<I, bool>::value>>
+    std::string_view append(I i) {
+        if constexpr (std::is_signed<I>::value) {
+            return append_int(static_cast<long long>(i));
+        } else {
+            return append_uint(static_cast<unsigned long long>(i));
+        }
+    }
+
+    // Shortest text that reads back as the exact same value.
+    std::string_view append(double d);
+    std::string_view append(float f);
+
+    // printf style formatting, without an intermediate buffer.
+    std::string_view format(const char *fmt, ...)
+    #if defined(__GNUC__)
+        __attribute__((format(printf, 2, 3)))
+    #endif
+        ;
+
+    size_t size() { return buf.size(); }
+    void clear() { buf.clear(); }
+    std::string_view view() { return { buf.data(), buf.size() }; }
+    // For C APIs. The terminator is not part of the contents, so appending
+    // more overwrites it.
+    const char *c_str() {
+        *buf.end = 0;
+        return buf.data();
+    }
+
+  private:
+    std::string_view append_int(long long i);
+    std::string_view append_uint(unsigned long long i);
+};
+
+
+// Reads from `fd` straight into the end of `v` until EOF or `max` bytes,
+// without any intermediate buffer. `v` must be able to grow that much, i.e.
+// an sa::vector, or a basic_vector on top of its stack.
+// Returns the amount of bytes read, or -1 on error (with errno set), in
+// which case `v` is left as it was, even if some reads succeeded.
+ptrdiff_t append_from_fd(int fd, basic_vector<uint8_t> &v, size_t max = SIZE_MAX);
+// Appends the entire contents of the file at `path`.
+bool read_file(const char *path, basic_vector<uint8_t> &v);
+
+
+// For spin loops: pauses the CPU for the first few rounds, then yields to
+// other threads, such that waiting on a descheduled thread doesn't burn a
+// whole core. Start `spins` at 0.
+void backoff(unsigned &spins);
+
+// A vector that many threads can append to at once: since memory never moves,
+// there is never a need for a resize lock, and appending is a single
+// fetch_add. Readers only see slots that are completely written, as the
+// prefix up to the first slot still being written (see snapshot()).
+// Locks 2 stacks (data and per-slot completion flags), so like other
+// vectors it must be created and destroyed on the same thread, though all
+// other methods can be used from any thread.
+template<typename T>
+struct concurrent_vector {
+    stack *st;
+    stack *flags_st;
+    T *elems;
+    // Slot i is complete once flags[i] is set. The flags stack holds whatever
+    // its earlier users left behind, so flags are cleared in chunks ahead of
+    // use, and only those below `cleared` mean anything.
+    std::atomic<uint32_t> *flags;
+    std::atomic<size_t> reserved { 0 };
+    // Chunks are claimed for clearing in any order, but `cleared` only
+    // advances past them in order.
+    std::atomic<size_t> clear_claimed { 0 };
+    std::atomic<size_t> cleared { 0 };
+    // All slots below this are known to be complete.
+    std::atomic<size_t> complete { 0 };
+
+    static constexpr size_t CLEAR_CHUNK = 4096;
+
+    concurrent_vector()
+        : st(acquire_stack()), flags_st(acquire_stack()),
+          elems(reinterpret_cast<T *>(align_up(st->sp, alignof(T)))),
+          flags(reinterpret_cast<std::atomic<uint32_t> *>(
+              align_up(flags_st->sp, alignof(std::atomic<uint32_t>)))) {}
+
+    ~concurrent_vector() {
+        auto n = reserved.load();
+        if constexpr (!std::is_trivially_destructible<T>::value) {
+            assert(size() == n);
+            for (size_t i = 0; i < n; i++) elems[i].~T();
+        }
+        flags_st->unwound(reinterpret_cast<uint8_t *>(flags + clear_claimed.load()));
+        release_stack(flags_st);
+        st->unwound(reinterpret_cast<uint8_t *>(elems + n));
+        release_stack(st);
+    }
+
+    concurrent_vector(const concurrent_vector &) = delete;
+    concurrent_vector &operator=(const concurrent_vector &) = delete;
+
+    // Returns the index the element ended up at.
+    size_t push_back(const T &t) {
+        auto i = claim(1);
+        new (elems + i) T(t);
+        publish(i, 1);
+        return i;
+    }
+
+    size_t push_multiple(const T *ts, size_t n) {
+        auto i = claim(n);
+        for (size_t j = 0; j < n; j++) new (elems + i + j) T(ts[j]);
+        publish(i, n);
+        return i;
+    }
+
+    // For writing slots in place: claim them, construct them at slot(i),
+    // then publish them.
+    size_t claim(size_t n) {
+        auto i = reserved.fetch_add(n, std::memory_order_relaxed);
+        clear_flags(i + n);
+        return i;
+    }
+    T *slot(size_t i) { return elems + i; }
+    void publish(size_t i, size_t n) {
+        for (size_t j = i; j < i + n; j++) flags[j].store(1, std::memory_order_release);
+    }
+
+    // Number of elements from the start that are complete. Lock-free, and
+    // advances past slots completed since the last call.
+    size_t size() {
+        auto n = complete.load(std::memory_order_acquire);
+        auto c = n;
+        auto r = reserved.load(std::memory_order_acquire);
+        auto cl = cleared.load(std::memory_order_acquire);
+        if (cl < r) r = cl;
+        while (c < r && flags[c].load(std::memory_order_acquire)) c++;
+        // Others may have advanced it further meanwhile.
+        while (c > n && !complete.compare_exchange_weak(n, c)) {}
+        return c;
     }
+
+    // A consistent view of all complete elements, which stays valid (and
+    // unchanging) while others keep appending.
+    struct view {
+        T *first;
+        T *last;
+        T *begin() const { return first; }
+        T *end() const { return last; }
+        size_t size() const { return last - first; }
+        T &operator[](size_t i) const { return first[i]; }
+    };
+
+    view snapshot() { return { elems, elems + size() }; }
+
+  private:
+    // Makes sure flags below `end` are cleared before anyone publishes into
+    // them. Each chunk is cleared by exactly one thread, so a flag can never
+    // be cleared after it has been set. Only waits when another thread is in
+    // the middle of clearing, once per CLEAR_CHUNK slots.
+    void clear_flags(size_t end) {
+        unsigned spins = 0;
+        while (cleared.load(std::memory_order_acquire) < end) {
+            auto from = clear_claimed.load(std::memory_order_relaxed);
+            if (from < end) {
+                auto to = from + (end - from > CLEAR_CHUNK ? end - from : CLEAR_CHUNK);
+                if (!clear_claimed.compare_exchange_weak(from, to)) continue;
+                for (auto i = from; i < to; i++) flags[i].store(0, std::memory_order_relaxed);
+                // Earlier chunks may still be getting cleared by others.
+                while (cleared.load(std::memory_order_acquire) != from) backoff(spins);
+                cleared.store(to, std::memory_order_release);
+                return;
+            }
+            backoff(spins);
+        }
+    }
+};
+
+// A stack backed by a (sparse) file with MAP_SHARED, such that its contents
+// persist across runs, and can be used again instantly without any
+// deserialization. Only for trivially copyable data without pointers,
+// since the mapping may land at a different address next time: use
+// offset_handle to refer to data inside it instead.
+// Only available on POSIX systems for now.
+#ifndef _WIN32
+
+struct persistent_stack {
+    struct header {
+        uint64_t magic;
+        uint64_t version;
+        // Bytes in use after the header.
+        uint64_t used;
+    };
+    static const uint64_t MAGIC = 0x4b434154534153ULL;  // "SASTACK"
+    static const uint64_t VERSION = 1;
+    // Data starts this far into the file, to keep it nicely aligned.
+    static const size_t HEADER_SIZE = 4096;
+
+    uint8_t *mapping = nullptr;
+    size_t mapping_size = 0;
+    int fd = -1;
+
+    persistent_stack() {}
+    ~persistent_stack() { close(); }
+
+    persistent_stack(const persistent_stack &) = delete;
+    persistent_stack &operator=(const persistent_stack &) = delete;
+
+    // Opens (or creates) the file at `path`, reserving room for at least
+    // `size` bytes of data. The file is sparse, so only uses disk space for
+    // what is actually written. Returns false on any error, or if the file
+    // is not one of ours (which is then left untouched).
+    bool open(const char *path, size_t size);
+    void close();
+    // Flushes everything to disk, blocking until it is written.
+    bool sync();
+
+    header *hdr() { return reinterpret_cast<header *>(mapping); }
+    uint8_t *memory() { return mapping + HEADER_SIZE; }
+    size_t size() { return mapping_size - HEADER_SIZE; }
+    uint8_t *used_end() { return memory() + hdr()->used; }
+    void set_used_end(uint8_t *end) {
+        assert(end >= memory() && end <= memory() + size());
+        hdr()->used = static_cast<uint64_t>(end - memory());
+    }
+};
+
+// Refers to a T inside a persistent_stack, valid across runs.
+template<typename T> struct offset_handle {
+    uint64_t offset = ~0ULL;
+
+    offset_handle() {}
+    offset_handle(persistent_stack &ps, const T *t)
+        : offset(static_cast<uint64_t>(reinterpret_cast<const uint8_t *>(t) - ps.memory())) {}
+
+    T *get(persistent_stack &ps) const { return reinterpret_cast<T *>(ps.memory() + offset); }
+    bool valid() const { return offset != ~0ULL; }
+};
+
+// Picks up where the last run left off. Appended data only becomes part of
+// the file's used size on commit() (or destruction).
+template<typename T>
+struct persistent_vector : basic_vector<T> {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "persistent data must be trivially copyable");
+
+    persistent_stack &ps;
+
+    persistent_vector(persistent_stack &ps) : basic_vector<T>(ps.memory()), ps(ps) {
+        this->end = ps.used_end();
+    }
+
+    ~persistent_vector() { commit(); }
+
+    void commit() { ps.set_used_end(this->end); }
+
+    offset_handle<T> handle(size_t i) { return offset_handle<T>(ps, &(*this)[i]); }
+};
+
+#endif
+
+
+// A stack in shared memory, mapped into several processes, each of which can
+// allocate from it concurrently (sp lives in the shared header, and is bumped
+// atomically). Since memory never moves, other processes can read data as
+// it gets added, without any copying.
+// Like persistent_stack, it is mapped at different addresses in each
+// process, so refer to data by offset.
+// Only supported on POSIX systems (memfd_create only on Linux) for now.
+#ifndef _WIN32
+
+struct shared_stack {
+    static_assert(std::atomic<uint64_t>::is_always_lock_free,
+                  "need address-free atomics for shared memory");
+
+    struct header {
+        uint64_t magic;
+        uint64_t version;
+        // Offsets from memory(): everything up to sp has been allocated,
+        // everything up to published is known to be ready to be read (see
+        // shared_vector).
+        std::atomic<uint64_t> sp;
+        std::atomic<uint64_t> published;
+    };
+    static const uint64_t MAGIC = 0x4d48534b43415453ULL;  // "STACKSHM"
+    static const uint64_t VERSION = 1;
+    static const size_t HEADER_SIZE = 4096;
+
+    uint8_t *mapping = nullptr;
+    size_t mapping_size = 0;
+    int fd = -1;
+
+    shared_stack() {}
+    ~shared_stack() { close(); }
+
+    shared_stack(const shared_stack &) = delete;
+    shared_stack &operator=(const shared_stack &) = delete;
+
+    // Creates a new named stack (shm_open), which others can open().
+    bool create(const char *name, size_t size);
+    // Creates an unnamed stack (memfd_create), to be shared by passing on
+    // fd, e.g. by fork() or over a unix domain socket, and attach()-ing.
+    bool create_anonymous(size_t size);
+    bool open(const char *name);
+    // Takes ownership of fd.
+    bool attach(int fd);
+    // Removes the name, the memory lives on until everyone closes it.
+    static bool remove(const char *name);
+    void close();
+
+    header *hdr() { return reinterpret_cast<header *>(mapping); }
+    uint8_t *memory() { return mapping + HEADER_SIZE; }
+    size_t size() { return mapping_size - HEADER_SIZE; }
+
+    // Safe to call from any process at any time. No capacity check.
+    uint8_t *alloc(size_t bytes) {
+        return memory() + hdr()->sp.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+  private:
+    bool attach(int fd, size_t size);
+};
+
+// A vector of trivially copyable records in a shared_stack, which must not
+// be used for anything else. Any process can push_back, and readers see
+// records once they are complete, in order.
+// Each record has a completion flag, so producers never wait for each other
+// (even for one that died halfway), and readers find the complete prefix.
+// Flags start out cleared since shared memory starts out zeroed, and records
+// are never removed.
+template<typename T>
+struct shared_vector {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "shared data must be trivially copyable");
+
+    struct slot {
+        T value;
+        std::atomic<uint32_t> complete;
+    };
+    static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                  "need address-free atomics for shared memory");
+
+    shared_stack &ss;
+
+    shared_vector(shared_stack &ss) : ss(ss) {}
+
+    void push_back(const T &t) {
+        auto s = reinterpret_cast<slot *>(ss.alloc(sizeof(slot)));
+        memcpy(&s->value, &t, sizeof(T));
+        s->complete.store(1, std::memory_order_release);
+    }
+
+    // Only counts records that are complete, along with all before them.
+    // Moves published forward for everyone as it finds more.
+    size_t size() {
+        auto &published = ss.hdr()->published;
+        auto start = published.load(std::memory_order_acquire);
+        auto allocated = ss.hdr()->sp.load(std::memory_order_relaxed);
+        auto limit = allocated < ss.size() ? allocated : ss.size();
+        auto end = start;
+        while (end + sizeof(slot) <= limit &&
+               slots()[end / sizeof(slot)].complete.load(std::memory_order_acquire)) {
+            end += sizeof(slot);
+        }
+        while (start < end &&
+               !published.compare_exchange_weak(start, end, std::memory_order_acq_rel)) {}
+        return (start > end ? start : end) / sizeof(slot);
+    }
+
+    T &operator[](size_t i) {
+        assert(i < size());
+        return slots()[i].value;
+    }
+
+  private:
+    slot *slots() { return reinterpret_cast<slot *>(ss.memory()); }
 };
 
+#endif
+
 
 // Since these vectors can safely have interior pointers, we can do more things
 // with them, like this one can have arbitrary elements reused.
+// Doesn't keep track of reuse, see vector_pool below for that.
 template<typename T>
-struct vector_pool : vector<T> {
+struct untracked_vector_pool : vector<T> {
     // Woah, we're using one of our own vectors as freelist!
-    // This will cause vector_pool to lock 2 stacks during its lifetime.
+    // This will cause the pool to lock 2 stacks during its lifetime.
     // Also fun: we track elements as pointers, because why not.
     vector<T *> free_list;
 
@@ -179,13 +1164,17 @@ struct vector_pool : vector<T> {
     // push_back, though push_back still works if you know you don't need
     // to reuse (such as at the start).
     T &alloc(const T &t) {
+        return emplace(t);
+    }
+
+    template<typename... Args> T &emplace(Args &&... args) {
         if (free_list.size()) {
+            // The old element is still alive, see below.
             auto tn = free_list.pop();
-            // FIXME: avoid copy / construct in place?
-            return *tn = t;
+            tn->~T();
+            return *new (tn) T(std::forward<Args>(args)...);
         } else {
-            this->push_back(t);
-            return this->back();
+            return this->emplace_back(std::forward<Args>(args)...);
         }
     }
 
@@ -199,34 +1188,653 @@ struct vector_pool : vector<T> {
     }
 };
 
+// An untracked_vector_pool that also hands out handles to its elements.
+// Locks a third stack for generations (see below).
+// INDEX_BITS splits handles between index and generation.
+template<typename T, unsigned INDEX_BITS = 24>
+struct vector_pool : untracked_vector_pool<T> {
+    static_assert(INDEX_BITS > 0 && INDEX_BITS < 32, "handles need index and generation bits");
+
+    // Bumped each time an element is made reuseable, so handles to what was
+    // there before can tell. Only grown as far as the highest index ever
+    // reused, anything past that is generation 0.
+    vector<uint32_t> generations;
+
+    // Refers to an element like a pointer would, in half the space on 64-bit,
+    // but can tell when that element has since been reused for something
+    // else. The low INDEX_BITS hold the index, so handles can only be made
+    // for the first 2^INDEX_BITS elements; the rest the generation, which
+    // wraps, so a handle only looks valid again after 2^(32 - INDEX_BITS)
+    // reuses.
+    struct handle {
+        uint32_t bits;
+
+        uint32_t index() const { return bits & ((uint32_t(1) << INDEX_BITS) - 1); }
+    };
+
+    void reuseable(T &t) {
+        untracked_vector_pool<T>::reuseable(t);
+        auto i = index_of(t);
+        while (generations.size() <= i) generations.push_back(0);
+        generations[i]++;
+    }
+
+    handle handle_of(T &t) {
+        auto i = index_of(t);
+        assert(i < (size_t(1) << INDEX_BITS) && "too many elements for INDEX_BITS");
+        return { pack(i) };
+    }
+
+    // Whether h still refers to the element it was made for, i.e. that
+    // element hasn't been made reuseable since.
+    bool valid(handle h) {
+        return h.index() < this->size() && pack(h.index()) == h.bits;
+    }
+
+    // nullptr if h is no longer valid.
+    T *get(handle h) {
+        return valid(h) ? &(*this)[h.index()] : nullptr;
+    }
+
+  private:
+    size_t index_of(T &t) {
+        return static_cast<size_t>(&t - this->data());
+    }
+
+    // Generations past what fits are cut off by the shift, i.e. wrap.
+    uint32_t pack(size_t i) {
+        auto generation = i < generations.size() ? generations[i] : 0;
+        return static_cast<uint32_t>(i) | generation << INDEX_BITS;
+    }
+};
+
+// Like vector_pool, but for any objects up to MAX_SIZE bytes, as a general
+// replacement for new/delete of small nodes. Each power of 2 size class gets
+// a stack of its own, and freed slots are chained thru their own memory, so
+// no separate free list is needed.
+// Locks NUM_CLASSES stacks. Objects still alive when the pool goes away are
+// not destructed.
+struct object_pool {
+    static constexpr size_t MIN_SIZE = 16;
+    static constexpr size_t MAX_SIZE = 4096;
+    static constexpr size_t NUM_CLASSES = 9;
+
+    struct size_class {
+        stack *st;
+        uint8_t *top;
+        void *free_list;
+    };
+    size_class classes[NUM_CLASSES];
+
+    object_pool() {
+        for (size_t c = 0; c < NUM_CLASSES; c++) {
+            auto st = acquire_stack();
+            // Slots are naturally aligned to their size.
+            classes[c] = { st, align_up(st->sp, MIN_SIZE << c), nullptr };
+        }
+    }
+
+    ~object_pool() {
+        for (size_t c = NUM_CLASSES; c-- > 0;) {
+            classes[c].st->unwound(classes[c].top);
+            release_stack(classes[c].st);
+        }
+    }
+
+    object_pool(const object_pool &) = delete;
+    object_pool &operator=(const object_pool &) = delete;
+
+    static constexpr size_t class_of(size_t bytes) {
+        size_t c = 0;
+        while ((MIN_SIZE << c) < bytes) c++;
+        return c;
+    }
+
+    void *alloc(size_t bytes) {
+        assert(bytes <= MAX_SIZE);
+        auto &sc = classes[class_of(bytes)];
+        if (auto p = sc.free_list) {
+            sc.free_list = *static_cast<void **>(p);
+            return p;
+        }
+        auto p = sc.top;
+        sc.top += MIN_SIZE << class_of(bytes);
+        return p;
+    }
+
+    // Like sized delete, needs the size that was passed to alloc.
+    void free(void *p, size_t bytes) {
+        auto &sc = classes[class_of(bytes)];
+        assert(static_cast<uint8_t *>(p) >= sc.st->memory && static_cast<uint8_t *>(p) < sc.top);
+        *static_cast<void **>(p) = sc.free_list;
+        sc.free_list = p;
+    }
+
+    template<typename T, typename... Args> T *create(Args &&... args) {
+        static_assert(sizeof(T) <= MAX_SIZE, "too big for object_pool");
+        return new (alloc(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template<typename T> void destroy(T *t) {
+        t->~T();
+        free(t, sizeof(T));
+    }
+};
+
+// A hash map whose entries live in a vector pool, so references to keys and
+// values stay valid until that entry is erased, rehashing or not. Lookups go
+// thru an open addressing (linear probing) index on a stack of its own, which
+// is rebuilt in place when it grows.
+// Locks 3 stacks: the 2 of the untracked_vector_pool holding entries (which
+// has no use for handles), and the index.
+template<typename K, typename V, typename Hash = std::hash<K>,
+         typename Eq = std::equal_to<K>>
+struct hash_map {
+    struct entry {
+        K key;
+        V value;
+
+        template<typename... Args> entry(const K &k, Args &&... args)
+            : key(k), value(std::forward<Args>(args)...) {}
+    };
+
+    untracked_vector_pool<entry> entries;
+    struct slot {
+        // Top 32 bits of the mixed hash, so rehashing and most mismatches
+        // don't need to touch the entries.
+        uint32_t hash;
+        uint32_t entry;
+    };
+    static const uint32_t EMPTY = 0xFFFFFFFF;
+    static const uint32_t ERASED = 0xFFFFFFFE;
+    vector<slot> index;
+    size_t live = 0;
+    size_t used = 0;  // Live + erased slots.
+
+    hash_map() { rehash(16); }
+
+    size_t size() const { return live; }
+
+    V *find(const K &k) {
+        auto h = hash(k);
+        auto mask = index.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            auto &s = index[i];
+            if (s.entry == EMPTY) return nullptr;
+            if (s.hash == h && s.entry != ERASED && Eq()(entries[s.entry].key, k))
+                return &entries[s.entry].value;
+        }
+    }
+
+    bool contains(const K &k) { return find(k) != nullptr; }
+
+    // Like std::unordered_map, does nothing if k is already present. Returns
+    // the value for k, and whether it was inserted.
+    template<typename... Args> std::pair<V *, bool> emplace(const K &k, Args &&... args) {
+        if ((used + 1) * 4 > index.size() * 3) {
+            // Only grow if it's not mostly erased slots taking up space.
+            rehash(live * 2 >= index.size() ? index.size() * 2 : index.size());
+        }
+        auto h = hash(k);
+        auto mask = index.size() - 1;
+        slot *reuse = nullptr;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            auto &s = index[i];
+            if (s.entry == EMPTY) {
+                if (!reuse) {
+                    reuse = &s;
+                    used++;
+                }
+                break;
+            }
+            if (s.entry == ERASED) {
+                if (!reuse) reuse = &s;
+            } else if (s.hash == h && Eq()(entries[s.entry].key, k)) {
+                return { &entries[s.entry].value, false };
+            }
+        }
+        auto &e = entries.emplace(k, std::forward<Args>(args)...);
+        *reuse = { h, static_cast<uint32_t>(&e - entries.data()) };
+        live++;
+        return { &e.value, true };
+    }
+
+    std::pair<V *, bool> insert(const K &k, const V &v) { return emplace(k, v); }
+
+    V &operator[](const K &k) { return *emplace(k).first; }
+
+    bool erase(const K &k) {
+        auto h = hash(k);
+        auto mask = index.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            auto &s = index[i];
+            if (s.entry == EMPTY) return false;
+            if (s.hash == h && s.entry != ERASED && Eq()(entries[s.entry].key, k)) {
+                // Like vector_pool, the entry stays alive until reused.
+                entries.reuseable(entries[s.entry]);
+                s.entry = ERASED;
+                live--;
+                return true;
+            }
+        }
+    }
+
+    // Calls f(key, value) for all entries, in no particular order.
+    template<typename F> void for_each(F f) {
+        for (size_t i = 0, n = index.size(); i < n; i++) {
+            auto &s = index[i];
+            if (s.entry < ERASED) f(entries[s.entry].key, entries[s.entry].value);
+        }
+    }
+
+  private:
+    static uint32_t hash(const K &k) {
+        // std::hash is often the identity, so mix it up.
+        return static_cast<uint32_t>((static_cast<uint64_t>(Hash()(k)) * 0x9E3779B97F4A7C15ULL) >> 32);
+    }
+
+    void rehash(size_t capacity) {
+        // Nothing else uses the index stack, so build the new table right
+        // after the old one, then move it down.
+        auto old_size = index.size();
+        for (size_t i = 0; i < capacity; i++) index.push_back({ 0, EMPTY });
+        auto old = index.data();
+        auto fresh = old + old_size;
+        auto mask = capacity - 1;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].entry >= ERASED) continue;
+            auto j = old[i].hash & mask;
+            while (fresh[j].entry != EMPTY) j = (j + 1) & mask;
+            fresh[j] = old[i];
+        }
+        memmove(old, fresh, capacity * sizeof(slot));
+        index.end = index.begin + capacity * sizeof(slot);
+        used = live;
+    }
+};
+
 template<typename T, typename S>
 struct vector_nested {
     uint8_t *start;
 
     size_t size() { return static_cast<size_t>(*reinterpret_cast<S *>(start)); }
-    T *begin() { return reinterpret_cast<T *>(start + sizeof(S)); }
+    T *begin() { return reinterpret_cast<T *>(align_up(start + sizeof(S), alignof(T))); }
+    T *end() { return begin() + size(); }
 };
 
 // How about a vector of vectors, all inline?
 // This is now more practical than with std::vector, since we can now
-// have pointers to the interior vectors and pass them on.
+// have pointers to the interior records and pass them on.
 // This essentially is a vector<vector_fixed>, though the C++
-// typesystem doesn't understand variable sized types.
-// The template parameter S is for the size type of interior vectors,
-// for example this could be uint8_t if you wanted to store lots of
-// small strings compactly.
-// TODO: make it work with any variable length thing, not just vector_nested.
+// typesystem doesn't understand variable sized types, so instead a traits
+// type R describes the records:
+//
+//   using view = ...;                      // What reading a record returns.
+//   static constexpr size_t align;         // Every record starts aligned.
+//   static size_t size_for(args...);       // Bytes needed to store args.
+//   static void write(uint8_t *, args...); // Stores them.
+//   static size_t size_of(const uint8_t *); // Bytes a stored record takes.
+//   static view read(uint8_t *);
+//
+// Records can be walked in order, and with Indexed, there is also a side
+// index of offsets (on another stack) for O(1) random access.
+struct no_index {};
+
+template<typename R, bool Indexed = false>
+struct record_log {
+    vector<uint8_t> buf { alignment(R::align) };
+    std::conditional_t<Indexed, vector<size_t>, no_index> offsets;
+    size_t count = 0;
+
+    using view = typename R::view;
+
+    template<typename... Args> view push_back(const Args &... args) {
+        auto rec = buf.end;
+        if constexpr (Indexed) offsets.push_back(rec - buf.begin);
+        R::write(rec, args...);
+        // Pad after rather than before, so the next record (or the end) is
+        // always where iteration expects it.
+        buf.end = align_up(rec + R::size_for(args...), R::align);
+        count++;
+        return R::read(rec);
+    }
+
+    size_t size() const { return count; }
+
+    template<bool I = Indexed, typename = std::enable_if_t<I>>
+    view operator[](size_t i) { return R::read(buf.begin + offsets[i]); }
+
+    void clear() {
+        buf.end = buf.begin;
+        if constexpr (Indexed) offsets.clear();
+        count = 0;
+    }
+
+    struct iterator {
+        uint8_t *rec;
+        view operator*() const { return R::read(rec); }
+        iterator &operator++() {
+            rec = align_up(rec + R::size_of(rec), R::align);
+            return *this;
+        }
+        bool operator!=(const iterator &o) const { return rec != o.rec; }
+        bool operator==(const iterator &o) const { return rec == o.rec; }
+    };
+
+    iterator begin() { return { buf.begin }; }
+    iterator end() { return { buf.end }; }
+};
+
+// Arrays of T prefixed by their size, stored as type S. For example S could
+// be uint8_t if you wanted to store lots of small arrays compactly.
 template<typename T, typename S>
-struct vector_of_vectors {
-    vector<uint8_t> buf;
+struct array_record {
+    static_assert(std::is_trivially_copyable<T>::value, "records are stored as bytes");
+    using view = vector_nested<T, S>;
+    static constexpr size_t align = alignof(S) > alignof(T) ? alignof(S) : alignof(T);
+    // Where the elements start, relative to the (aligned) record.
+    static constexpr size_t header = (sizeof(S) + alignof(T) - 1) / alignof(T) * alignof(T);
 
-    vector_nested<T,S> push_back(const T *elems, size_t size) {
-        auto vn = vector_nested<T,S> { buf->begin };
-        auto st = static_cast<S>(size);
-        buf.push_multiple(reinterpret_cast<const uint8_t *>(&st), sizeof(S));
-        buf.push_multiple(reinterpret_cast<const uint8_t *>(elems), size sizeof(T));
-        return vn;
+    static size_t size_for(const T *, size_t size) { return header + size * sizeof(T); }
+    static void write(uint8_t *rec, const T *elems, size_t size) {
+        auto s = static_cast<S>(size);
+        assert(static_cast<size_t>(s) == size);
+        memcpy(rec, &s, sizeof(S));
+        memcpy(rec + header, elems, size * sizeof(T));
     }
+    static size_t size_of(const uint8_t *rec) {
+        S s;
+        memcpy(&s, rec, sizeof(S));
+        return header + static_cast<size_t>(s) * sizeof(T);
+    }
+    static view read(uint8_t *rec) { return { rec }; }
+};
+
+// Length prefixed strings, read back as string_views.
+template<typename S = uint32_t>
+struct string_record {
+    using view = std::string_view;
+    static constexpr size_t align = alignof(S);
+
+    static size_t size_for(std::string_view str) { return sizeof(S) + str.size(); }
+    static void write(uint8_t *rec, std::string_view str) {
+        auto s = static_cast<S>(str.size());
+        assert(static_cast<size_t>(s) == str.size());
+        memcpy(rec, &s, sizeof(S));
+        memcpy(rec + sizeof(S), str.data(), str.size());
+    }
+    static size_t size_of(const uint8_t *rec) {
+        S s;
+        memcpy(&s, rec, sizeof(S));
+        return sizeof(S) + static_cast<size_t>(s);
+    }
+    static view read(uint8_t *rec) {
+        return { reinterpret_cast<const char *>(rec + sizeof(S)), size_of(rec) - sizeof(S) };
+    }
+};
+
+template<typename T, typename S>
+using vector_of_vectors = record_log<array_record<T, S>>;
+
+
+// Sorting large vectors on all cores. Scratch space (as much again as the
+// vector itself) comes from a stack of its own rather than the heap. The
+// only heap allocations are for starting the worker threads, once per sort.
+
+size_t hardware_threads();
+
+// Threads that run rounds of tasks (e.g. every pass of a sort) without
+// being restarted for each. The caller takes part as one of the `size`.
+struct thread_team {
+    explicit thread_team(size_t size);
+    ~thread_team();
+
+    thread_team(const thread_team &) = delete;
+    thread_team &operator=(const thread_team &) = delete;
+
+    size_t size() const { return members; }
+
+    // Runs task(ctx, i) for all i in [0, tasks), spread over the team, and
+    // waits for all of them.
+    void run(size_t tasks, void (*task)(void *ctx, size_t i), void *ctx);
+
+    template<typename F> void run(size_t tasks, F &&f) {
+        using FT = std::remove_reference_t<F>;
+        run(tasks, [](void *ctx, size_t i) { (*static_cast<FT *>(ctx))(i); }, &f);
+    }
+
+  private:
+    struct state;
+    size_t members;
+    state *s = nullptr;
 };
 
+// Below this many elements per thread, it's not worth starting one.
+static constexpr size_t SORT_GRAIN = 1 << 16;
+
+inline size_t sort_threads(size_t n, size_t threads) {
+    if (!threads) threads = hardware_threads();
+    auto useful = n / SORT_GRAIN;
+    return useful < 1 ? 1 : useful < threads ? useful : threads;
+}
+
+// Integers and floats sort by their bits, once mapped by radix_key.
+template<typename T> constexpr bool is_radix_sortable =
+    (std::is_integral<T>::value && !std::is_same<T, bool>::value) ||
+    (std::is_floating_point<T>::value && (sizeof(T) == 4 || sizeof(T) == 8));
+
+template<typename T> using radix_key_t = std::conditional_t<sizeof(T) == 1, uint8_t,
+    std::conditional_t<sizeof(T) == 2, uint16_t,
+    std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>>;
+
+// Unsigned, and in the same order as the values.
+template<typename T> radix_key_t<T> radix_key(T t) {
+    using K = radix_key_t<T>;
+    K k;
+    memcpy(&k, &t, sizeof(T));
+    const K top = static_cast<K>(K(1) << (sizeof(T) * 8 - 1));
+    if constexpr (std::is_floating_point<T>::value) {
+        // Negatives are in reverse order as bits.
+        return (k & top) ? static_cast<K>(~k) : static_cast<K>(k | top);
+    } else if constexpr (std::is_signed<T>::value) {
+        return static_cast<K>(k ^ top);
+    } else {
+        return k;
+    }
+}
+
+// Whether F extracts a radix sortable key from a T, rather than comparing.
+template<typename F, typename T, typename = void> struct is_sort_key : std::false_type {};
+template<typename F, typename T>
+struct is_sort_key<F, T, std::enable_if_t<is_radix_sortable<
+    std::decay_t<std::invoke_result_t<F &, const T &>>>>> : std::true_type {};
+
+// LSD radix sort on key(t), a byte at a time. Each thread counts, then
+// scatters, its own chunk, which keeps every pass stable.
+template<typename T, typename Key> void radix_sort(T *data, T *tmp, size_t n, thread_team &team, Key key) {
+    using K = std::decay_t<std::invoke_result_t<Key &, const T &>>;
+    auto threads = team.size();
+    vector<size_t> counts;
+    for (size_t i = 0; i < threads * 256; i++) counts.push_back(0);
+    auto chunk = (n + threads - 1) / threads;
+    auto src = data, dst = tmp;
+    for (size_t shift = 0; shift < sizeof(K) * 8; shift += 8) {
+        auto digit = [shift, &key](const T &t) {
+            return static_cast<size_t>(radix_key<K>(key(t)) >> shift) & 0xFF;
+        };
+        team.run(threads, [&](size_t t) {
+            auto c = &counts[t * 256];
+            memset(c, 0, 256 * sizeof(size_t));
+            for (size_t i = t * chunk, e = i + chunk < n ? i + chunk : n; i < e; i++) c[digit(src[i])]++;
+        });
+        // Nothing to do if this byte is the same everywhere, which is common
+        // for the high bytes.
+        size_t same = 0;
+        for (size_t t = 0; t < threads; t++) same += counts[t * 256 + digit(src[0])];
+        if (same == n) continue;
+        // Turn counts into where each thread writes each digit.
+        size_t offset = 0;
+        for (size_t d = 0; d < 256; d++) {
+            for (size_t t = 0; t < threads; t++) {
+                auto c = counts[t * 256 + d];
+                counts[t * 256 + d] = offset;
+                offset += c;
+            }
+        }
+        team.run(threads, [&](size_t t) {
+            auto c = &counts[t * 256];
+            for (size_t i = t * chunk, e = i + chunk < n ? i + chunk : n; i < e; i++) {
+                dst[c[digit(src[i])]++] = std::move(src[i]);
+            }
+        });
+        std::swap(src, dst);
+    }
+    if (src != data) std::move(src, src + n, data);
+}
+
+// How many of the first d elements of merging a and b come from a.
+template<typename T, typename Compare>
+size_t merge_path(const T *a, size_t na, const T *b, size_t nb, size_t d, Compare &comp) {
+    size_t lo = d > nb ? d - nb : 0, hi = d < na ? d : na;
+    while (lo < hi) {
+        auto i = lo + (hi - lo) / 2;
+        // Ties go to a, like std::merge.
+        if (comp(b[d - i - 1], a[i])) hi = i;
+        else lo = i + 1;
+    }
+    return lo;
+}
+
+// Sorts a run per thread, then merges runs pairwise. Each merge is split
+// along its merge path, so all threads stay busy until the last merge.
+// tmp must hold n valid (assignable) elements.
+template<typename T, typename Compare>
+void merge_sort(T *data, T *tmp, size_t n, thread_team &team, Compare comp) {
+    auto threads = team.size();
+    auto chunk = (n + threads - 1) / threads;
+    team.run(threads, [&](size_t t) {
+        auto first = data + (t * chunk < n ? t * chunk : n);
+        auto last = data + ((t + 1) * chunk < n ? (t + 1) * chunk : n);
+        std::sort(first, last, comp);
+    });
+    auto src = data, dst = tmp;
+    vector<size_t> splits;
+    for (size_t width = chunk; width < n; width *= 2) {
+        auto pairs = (n + 2 * width - 1) / (2 * width);
+        auto pieces = threads > pairs ? threads / pairs : 1;
+        auto runs = [&](size_t p, T *&a, size_t &na, T *&b, size_t &nb) {
+            auto start = p * 2 * width;
+            a = src + start;
+            na = width < n - start ? width : n - start;
+            b = a + na;
+            nb = width < n - start - na ? width : n - start - na;
+        };
+        // Find all splits up front: merging moves elements out of the runs,
+        // so other threads can't search them once it starts.
+        splits.clear();
+        for (size_t p = 0; p < pairs; p++) {
+            T *a, *b;
+            size_t na, nb;
+            runs(p, a, na, b, nb);
+            for (size_t k = 0; k <= pieces; k++) {
+                splits.push_back(merge_path(a, na, b, nb, (na + nb) * k / pieces, comp));
+            }
+        }
+        team.run(pairs * pieces, [&](size_t task) {
+            auto p = task / pieces, k = task % pieces;
+            T *a, *b;
+            size_t na, nb;
+            runs(p, a, na, b, nb);
+            auto d0 = (na + nb) * k / pieces, d1 = (na + nb) * (k + 1) / pieces;
+            auto i0 = splits[p * (pieces + 1) + k], i1 = splits[p * (pieces + 1) + k + 1];
+            std::merge(std::make_move_iterator(a + i0), std::make_move_iterator(a + i1),
+                       std::make_move_iterator(b + (d0 - i0)), std::make_move_iterator(b + (d1 - i1)),
+                       dst + (a - src) + d0, comp);
+        });
+        std::swap(src, dst);
+    }
+    if (src != data) std::move(src, src + n, data);
+}
+
+// Calls sort(data, tmp) with the elements of v and a buffer of as many
+// valid elements, without copying any: copies of e.g. strings would
+// allocate. The result must end up in data.
+template<typename T, typename Sort> void sort_with_scratch(basic_vector<T> &v, Sort sort) {
+    auto n = v.size();
+    vector<T> scratch;
+    if constexpr (std::is_trivially_copyable<T>::value) {
+        scratch.end += n * sizeof(T);
+        sort(v.data(), scratch.data());
+    } else if constexpr (std::is_default_constructible<T>::value) {
+        for (size_t i = 0; i < n; i++) scratch.emplace_back();
+        sort(v.data(), scratch.data());
+    } else {
+        // Sort in scratch instead, with the moved-from elements as buffer.
+        for (size_t i = 0; i < n; i++) scratch.push_back(std::move(v.data()[i]));
+        sort(scratch.data(), v.data());
+        std::move(scratch.data(), scratch.data() + n, v.data());
+    }
+}
+
+// Sorts v by comp, using up to `threads` threads (0 for all cores).
+template<typename T, typename Compare,
+         typename = std::enable_if_t<!std::is_integral<Compare>::value && !is_sort_key<Compare, T>::value>>
+void parallel_sort(basic_vector<T> &v, Compare comp, size_t threads = 0) {
+    auto n = v.size();
+    threads = sort_threads(n, threads);
+    if (threads == 1) {
+        std::sort(v.data(), v.data() + n, comp);
+        return;
+    }
+    thread_team team(threads);
+    sort_with_scratch(v, [&](T *data, T *tmp) { merge_sort(data, tmp, n, team, comp); });
+}
+
+// Stable sort of v by key(t), which must return an integer or float, so
+// records get radix sorted too.
+template<typename T, typename Key, typename = std::enable_if_t<is_sort_key<Key, T>::value>, typename = void>
+void parallel_sort(basic_vector<T> &v, Key key, size_t threads = 0) {
+    auto n = v.size();
+    threads = sort_threads(n, threads);
+    if (n < 256) {
+        std::stable_sort(v.data(), v.data() + n, [&](const T &a, const T &b) {
+            return radix_key(key(a)) < radix_key(key(b));
+        });
+        return;
+    }
+    thread_team team(threads);
+    sort_with_scratch(v, [&](T *data, T *tmp) { radix_sort(data, tmp, n, team, key); });
+}
+
+// Integers and floats get radix sorted, anything else uses operator<.
+template<typename T> void parallel_sort(basic_vector<T> &v, size_t threads = 0) {
+    if constexpr (is_radix_sortable<T>) {
+        auto n = v.size();
+        threads = sort_threads(n, threads);
+        if (n < 256) {
+            std::sort(v.data(), v.data() + n);
+            return;
+        }
+        vector<T> scratch;
+        scratch.end += n * sizeof(T);
+        thread_team team(threads);
+        radix_sort(v.data(), scratch.data(), n, team, [](T t) { return t; });
+    } else {
+        parallel_sort(v, std::less<T>(), threads);
+    }
+}
+
 }  // namespace sa
+
+// Hashes the contents, the same as std::hash<std::string_view> does for
+// fixed_string, so either can be used to look up the other.
+namespace std {
+template<typename T> struct hash<sa::vector_fixed<T>> {
+    size_t operator()(const sa::vector_fixed<T> &v) const {
+        static_assert(has_unique_object_representations<T>::value,
+                      "equal elements must have equal bytes");
+        return hash<string_view>()(string_view(
+            reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T)));
+    }
+};
+}  // namespace std
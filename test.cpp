@@ -1,4 +1,4 @@
-// Copyright 2020 Wouter van Oortmerssen. All rights reserved.
+﻿// Copyright 2020 Wouter van Oortmerssen. All rights reserved.
 //
 // Licensed under the Apache License, Version 2.0 (the "License");
 // you may not use this file except in compliance with the License.
@@ -15,30 +15,145 @@
 #include "stackalloc.h"
 
 #include <vector>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
 
-#ifdef _WIN32  // FIXME
-	#include <windows.h>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <unordered_map>
+
+#ifndef _WIN32
+	#include <sys/resource.h>
+	#include <sys/stat.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
 #endif
 
-// Quick benchmarking helper.
-template<typename F> double time_function(size_t max, F f) {
-    #ifdef _WIN32
-		LARGE_INTEGER time_frequency, time_start, time_end;
-		QueryPerformanceFrequency(&time_frequency);
-		QueryPerformanceCounter(&time_start);
-		for (size_t i = 0; i < max; i++) f();
-		QueryPerformanceCounter(&time_end);
-		return double(time_end.QuadPart - time_start.QuadPart) / double(time_frequency.QuadPart);
-    #else
-		for (size_t i = 0; i < max; i++) f();
+// Benchmarking helper: runs `f` in batches, and reports the median and p99
+// of the time per call (in nanoseconds) over all batches. Takes enough
+// batches for p99 to not simply be the slowest one.
+struct bench_result {
+	std::string name;
+	size_t elems;
+	double median_ns, p99_ns;
+};
+
+std::vector<bench_result> bench_results;
+
+// Returns a copy, as later calls may reallocate bench_results.
+template<typename F> bench_result time_function(const char *name, size_t elems, size_t max, F f) {
+	const size_t num_samples = 200;
+	auto batch = std::max<size_t>(1, max / num_samples);
+	auto run_batch = [&]() {
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < batch; i++) f();
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / batch;
+	};
+	// Warm up caches, page in stacks, etc.
+	run_batch();
+	std::vector<double> samples;
+	for (size_t i = 0; i < num_samples; i++) samples.push_back(run_batch());
+	std::sort(samples.begin(), samples.end());
+	bench_results.push_back({ name, elems, samples[num_samples / 2],
+							  samples[(num_samples * 99 - 1) / 100] });
+	return bench_results.back();
+}
+
+// Machine readable output of all benchmarks, to track regressions over time.
+void write_bench_results(const char *file_name, bool json) {
+	auto f = fopen(file_name, "w");
+	if (!f) {
+		printf("cannot write %s\n", file_name);
+		return;
+	}
+	if (json) fprintf(f, "[\n");
+	else fprintf(f, "name,elems,median_ns,p99_ns\n");
+	for (auto &r : bench_results) {
+		if (json) {
+			fprintf(f, "  { \"name\": \"%s\", \"elems\": %zu, \"median_ns\": %.2f, \"p99_ns\": %.2f }%s\n",
+					r.name.c_str(), r.elems, r.median_ns, r.p99_ns,
+					&r == &bench_results.back() ? "" : ",");
+		} else {
+			fprintf(f, "%s,%zu,%.2f,%.2f\n", r.name.c_str(), r.elems, r.median_ns, r.p99_ns);
+		}
+	}
+	if (json) fprintf(f, "]\n");
+	fclose(f);
+}
+
+// Page faults taken by this process so far, where we can tell.
+size_t page_faults() {
+	#ifdef _WIN32
 		return 0;
-    #endif
+	#else
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_minflt + usage.ru_majflt;
+	#endif
 }
 
-int main() {
+// Fill a large vector and scan it randomly, for each way of backing a stack.
+void bench_page_modes() {
+	const size_t num_elems = 1 << 24;  // 128MB of uint64_t.
+	const char *names[] = { "normal", "transparent_huge", "explicit_huge" };
+	for (auto mode : { sa::page_mode::normal, sa::page_mode::transparent_huge,
+					   sa::page_mode::explicit_huge }) {
+		sa::stack st;
+		if (!st.alloc(1ULL << 30, mode)) continue;
+		sa::basic_vector<uint64_t> v(st.sp);
+		auto faults = page_faults();
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < num_elems; i++) v.push_back(i);
+		auto filled = std::chrono::steady_clock::now();
+		faults = page_faults() - faults;
+		uint64_t sum = 0, r = 1;
+		for (size_t i = 0; i < num_elems; i++) {
+			r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+			sum += v[(r >> 20) & (num_elems - 1)];
+		}
+		auto scanned = std::chrono::steady_clock::now();
+		std::chrono::duration<double> fill_time = filled - start, scan_time = scanned - filled;
+		printf("[%s -> %s] fill: %.4f (%zu faults), random scan: %.1f M elems/s (%llu)\n",
+			   names[(int)mode], names[(int)st.pages], fill_time.count(), faults,
+			   num_elems / scan_time.count() / 1e6, (unsigned long long)sum);
+		// Single runs, too slow to repeat, so median and p99 are the same.
+		auto fill_ns = fill_time.count() * 1e9, scan_ns = scan_time.count() * 1e9;
+		auto pages = std::string(names[(int)mode]) + " -> " + names[(int)st.pages];
+		bench_results.push_back({ "fill " + pages, num_elems, fill_ns, fill_ns });
+		bench_results.push_back({ "random scan " + pages, num_elems, scan_ns, scan_ns });
+	}
+}
+
+// A tagged union of a double or a string, as a record_log record.
+struct value_record {
+	struct view { char tag; uint8_t *payload; };
+	static constexpr size_t align = alignof(double);
+	static size_t size_for(double) { return 2 * sizeof(double); }
+	static size_t size_for(const char *s) { return sizeof(double) + strlen(s) + 1; }
+	static void write(uint8_t *rec, double d) { rec[0] = 'd'; memcpy(rec + 8, &d, 8); }
+	static void write(uint8_t *rec, const char *s) { rec[0] = 's'; strcpy((char *)rec + 8, s); }
+	static size_t size_of(const uint8_t *rec) {
+		return rec[0] == 'd' ? 16 : 8 + strlen((const char *)rec + 8) + 1;
+	}
+	static view read(uint8_t *rec) { return { (char)rec[0], rec + 8 }; }
+};
+
+// Containers with static storage duration work too, even though they are
+// constructed before main, and destructed after thread-local state.
+static sa::vector<int> global_numbers;
+
+// All benchmarks, which take minutes (far longer in debug or sanitizer
+// builds), so only run with --bench.
+void run_benchmarks() {
 
 	const size_t num_iters = 100000;
-	int sum = 0;
+	unsigned sum = 0;
 
 	for (int num_elems : { 5, 50, 500 }) {
 
@@ -50,7 +165,7 @@ int main() {
 		};
 
 		// Bench this vector:
-		auto time1 = time_function(num_iters, [&]() {
+		auto time1 = time_function("stackalloc mix", num_elems, num_iters, [&]() {
 			// A vector with reserved storage, uses first stack, but does
 			// not "lock" it.
 			sa::vector_max<int> vm(num_elems);
@@ -72,7 +187,7 @@ int main() {
 		});
 
 		// VS the STL naively (no reserve):
-		auto time2 = time_function(num_iters, [&]() {
+		auto time2 = time_function("stl naive mix", num_elems, num_iters, [&]() {
 			std::vector<int> vm;
 			push_access_pop(vm);
 			std::vector<int> v1;
@@ -88,7 +203,7 @@ int main() {
 		});
 
 		// VS the STL optimally (with reserve):
-		auto time3 = time_function(num_iters, [&]() {
+		auto time3 = time_function("stl opt mix", num_elems, num_iters, [&]() {
 			std::vector<int> vm;
 			vm.reserve(num_elems);
 			push_access_pop(vm);
@@ -107,28 +222,240 @@ int main() {
 			}
 		});
 
-		printf("[%d elems] stackalloc: %.4f, stl naive: %.4f, stl opt: %.4f, ratio: %.2fx / %.2fx faster!\n",
-			   num_elems, time1, time2, time3, time2 / time1, time3 / time1);
+		printf("[%d elems] stackalloc: %.1fns, stl naive: %.1fns, stl opt: %.1fns, ratio: %.2fx / %.2fx faster!\n",
+			   num_elems, time1.median_ns, time2.median_ns, time3.median_ns,
+			   time2.median_ns / time1.median_ns, time3.median_ns / time1.median_ns);
+
+		// Individual containers, for tracking each of them separately.
+		time_function("sa::vector", num_elems, num_iters, [&]() {
+			sa::vector<int> v;
+			push_access_pop(v);
+		});
+		time_function("sa::vector_max", num_elems, num_iters, [&]() {
+			sa::vector_max<int> v(num_elems);
+			push_access_pop(v);
+		});
+		time_function("std::vector", num_elems, num_iters, [&]() {
+			std::vector<int> v;
+			push_access_pop(v);
+		});
+		time_function("std::vector reserve", num_elems, num_iters, [&]() {
+			std::vector<int> v;
+			v.reserve(num_elems);
+			push_access_pop(v);
+		});
+		// Allocate a bunch of objects, and churn them thru the free list.
+		auto alloc_reuse = [&](auto alloc, auto reuse) {
+			for (int i = 0; i < num_elems; i++) alloc(i);
+			for (int i = 0; i < num_elems; i++) {
+				reuse(i);
+				alloc(i);
+			}
+		};
+		time_function("sa::vector_pool", num_elems, num_iters, [&]() {
+			sa::vector_pool<int> pool;
+			alloc_reuse([&](int i) { pool.alloc(i); }, [&](int i) { pool.reuseable(pool[i]); });
+			sum += (int)pool.size();
+		});
+		time_function("std::vector<unique_ptr>", num_elems, num_iters, [&]() {
+			std::vector<std::unique_ptr<int>> pool;
+			alloc_reuse([&](int i) { pool.push_back(std::make_unique<int>(i)); },
+						[&](int i) { pool[i].reset(); });
+			sum += (int)pool.size();
+		});
+		std::vector<int *> ptrs(num_elems);
+		time_function("sa::object_pool", num_elems, num_iters, [&]() {
+			sa::object_pool pool;
+			alloc_reuse([&](int i) { ptrs[i] = pool.create<int>(i); },
+						[&](int i) { pool.destroy(ptrs[i]); });
+			sum += *ptrs[0];
+		});
+		time_function("new/delete", num_elems, num_iters, [&]() {
+			for (int i = 0; i < num_elems; i++) ptrs[i] = new int(i);
+			for (int i = 0; i < num_elems; i++) {
+				delete ptrs[i];
+				ptrs[i] = new int(i);
+			}
+			sum += *ptrs[0];
+			for (auto p : ptrs) delete p;
+		});
+
+	}
+
+	// Existing std::pmr containers on a stack, VS the standard arena.
+	for (int num_elems : { 5, 50, 500 }) {
+		auto use_pmr = [&](std::pmr::memory_resource *mr) {
+			std::pmr::vector<int> v(mr);
+			std::pmr::unordered_map<int, std::pmr::string> m(mr);
+			for (int i = 0; i < num_elems; i++) {
+				v.push_back(i);
+				m.emplace(i, "some string long enough to need an allocation");
+			}
+			sum += (int)(v.size() + m.size());
+		};
+		auto time1 = time_function("sa::stack_resource", num_elems, num_iters / 10, [&]() {
+			sa::stack_resource mr;
+			use_pmr(&mr);
+		});
+		auto time2 = time_function("std::pmr::monotonic_buffer_resource", num_elems, num_iters / 10, [&]() {
+			std::pmr::monotonic_buffer_resource mr;
+			use_pmr(&mr);
+		});
+		printf("[%d elems] stack_resource: %.1fns, monotonic_buffer_resource: %.1fns, ratio: %.2fx faster!\n",
+			   num_elems, time1.median_ns, time2.median_ns, time2.median_ns / time1.median_ns);
+	}
+
+	// Bulk operations VS going thru operator[].
+	{
+		const int num_elems = 1 << 20;
+		sa::vector<int> v;
+		for (int i = 0; i < num_elems; i++) v.push_back(i & 0xFF);
+		auto time1 = time_function("sa::vector count()", num_elems, 500, [&]() {
+			sum += (int)v.count(7);
+		});
+		auto time2 = time_function("sa::vector count loop", num_elems, 500, [&]() {
+			int c = 0;
+			for (int i = 0; i < num_elems; i++) c += v[i] == 7;
+			sum += c;
+		});
+		printf("[%d elems] count(): %.1fns, loop: %.1fns, ratio: %.2fx faster!\n",
+			   num_elems, time1.median_ns, time2.median_ns, time2.median_ns / time1.median_ns);
+	}
+
+	// Building text, e.g. JSON output.
+	{
+		const int num_elems = 1000;
+		auto time1 = time_function("sa::string_builder", num_elems, num_iters / 10, [&]() {
+			sa::string_builder sb;
+			for (int i = 0; i < num_elems; i++) {
+				sb.append("{\"id\":");
+				sb.append(i);
+				sb.append(",\"value\":");
+				sb.append(i * 0.5);
+				sb.append("},");
+			}
+			sum += (int)sb.size();
+		});
+		auto time2 = time_function("std::string + snprintf", num_elems, num_iters / 10, [&]() {
+			std::string s;
+			char tmp[64];
+			for (int i = 0; i < num_elems; i++) {
+				s += "{\"id\":";
+				snprintf(tmp, sizeof(tmp), "%d", i);
+				s += tmp;
+				s += ",\"value\":";
+				snprintf(tmp, sizeof(tmp), "%.17g", i * 0.5);
+				s += tmp;
+				s += "},";
+			}
+			sum += (int)s.size();
+		});
+		printf("[%d elems] string_builder: %.1fns, std::string: %.1fns, ratio: %.2fx faster!\n",
+			   num_elems, time1.median_ns, time2.median_ns, time2.median_ns / time1.median_ns);
+	}
+
+	// Sorting.
+	{
+		const int num_elems = 1 << 18;
+		std::vector<int> input;
+		for (int i = 0; i < num_elems; i++) input.push_back((int)((unsigned)rand() << 15 ^ (unsigned)rand()));
+		sa::vector<int> v;
+		v.push_multiple(input.data(), input.size());
+		auto time1 = time_function("sa::parallel_sort", num_elems, 50, [&]() {
+			memcpy(v.data(), input.data(), num_elems * sizeof(int));
+			sa::parallel_sort(v);
+			sum += v[0];
+		});
+		auto time2 = time_function("std::sort", num_elems, 50, [&]() {
+			memcpy(v.data(), input.data(), num_elems * sizeof(int));
+			std::sort(v.data(), v.data() + num_elems);
+			sum += v[0];
+		});
+		printf("[%d elems] parallel_sort: %.1fns, std::sort: %.1fns, ratio: %.2fx faster!\n",
+			   num_elems, time1.median_ns, time2.median_ns, time2.median_ns / time1.median_ns);
+	}
+
+	// Hash maps: inserts, lookups and erases.
+	for (int num_elems : { 100, 10000 }) {
+		auto use_map = [&](auto &m, auto found) {
+			for (int i = 0; i < num_elems; i++) m[i * 7] = i;
+			for (int i = 0; i < num_elems; i++) sum += found(m, i * 7);
+			for (int i = 0; i < num_elems; i += 2) m.erase(i * 7);
+			for (int i = 0; i < num_elems; i += 2) m[i * 7 + 1] = i;
+		};
+		auto time1 = time_function("sa::hash_map", num_elems, num_iters / 10, [&]() {
+			sa::hash_map<int, int> m;
+			use_map(m, [](auto &m, int k) { return m.find(k) != nullptr; });
+			sum += (int)m.size();
+		});
+		auto time2 = time_function("std::unordered_map", num_elems, num_iters / 10, [&]() {
+			std::unordered_map<int, int> m;
+			use_map(m, [](auto &m, int k) { return m.find(k) != m.end(); });
+			sum += (int)m.size();
+		});
+		printf("[%d elems] hash_map: %.1fns, unordered_map: %.1fns, ratio: %.2fx faster!\n",
+			   num_elems, time1.median_ns, time2.median_ns, time2.median_ns / time1.median_ns);
+	}
+
+	bench_page_modes();
+}
 
+int main(int argc, char **argv) {
+
+	// --csv <file> and --json <file> write out benchmark results, so imply
+	// --bench.
+	bool bench = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--bench") || !strcmp(argv[i], "--csv") || !strcmp(argv[i], "--json")) {
+			bench = true;
+		}
 	}
 
 	// More examples.
 
+	for (int i = 0; i < 100; i++) global_numbers.push_back(i);
+	assert(global_numbers.size() == 100);
+
 	struct MyObject { int a; };
 	// Is it a vector, an allocator.. who knows?
 	sa::vector_pool<MyObject> pool;
 	auto &o1 = pool.alloc({ 1 });
 	auto &o2 = pool.alloc({ 2 });
 	auto &o3 = pool.alloc({ 3 });
+	// Handles are like pointers, but know when they've gone stale.
+	auto h2 = pool.handle_of(o2);
+	assert(pool.get(h2) == &o2);
 	// Let's free one in the middle:
 	pool.reuseable(o2);
 	// Still legal to access, we've only signed it up for overwriting.
 	assert(o2.a == 2);
+	assert(!pool.valid(h2));
 	auto &o4 = pool.alloc({ 4 });
 	// Overwritten now.
 	assert(o2.a == 4);
 	assert(o4.a == 4);
 	assert(&o2 == &o4);
+	// The old handle doesn't alias the new element.
+	assert(!pool.get(h2) && pool.get(pool.handle_of(o4)) == &o4);
+	static_assert(sizeof(h2) == 4, "handles are half a pointer on 64-bit");
+	// The index/generation split is configurable: with 2 generation bits,
+	// a stale handle looks valid again after 4 reuses.
+	sa::vector_pool<int, 30> small_gens;
+	auto &i1 = small_gens.alloc(1);
+	auto hi = small_gens.handle_of(i1);
+	for (int i = 0; i < 4; i++) {
+		assert(small_gens.valid(hi) == (i == 0));
+		small_gens.reuseable(i1);
+		small_gens.alloc(2);
+	}
+	assert(small_gens.valid(hi));
+	(void)hi;
+	// Elements past what handles can refer to are fine, as long as nobody
+	// asks for a handle to them.
+	sa::vector_pool<int, 4> small_index;
+	for (int i = 0; i < 20; i++) small_index.alloc(i);
+	small_index.reuseable(small_index[19]);
+	assert(small_index.alloc(-1) == -1 && small_index[19] == -1);
 	(void)o1;
 	(void)o3;
 	(void)o4;
@@ -138,10 +465,633 @@ int main() {
 		// Low level test: see if random access works when not using guard pages.
 		auto st = sa::acquire_stack();
 		for (int i = 0; i < 100000; i++) {
-			auto r = rand();
+			auto r = rand() & 0x7FFF;  // RAND_MAX differs per platform.
 			st->sp[(r << 14) + r] = 1;
 		}
-		sa::release_stack();
+		sa::release_stack(st);
+	}
+
+	// Vectors don't need to go away in the order they were made, e.g. when
+	// they live on the heap.
+	{
+		auto a = new sa::vector<int>;
+		auto b = new sa::vector<int>;
+		for (int i = 0; i < 1000; i++) {
+			a->push_back(i);
+			b->push_back(-i);
+		}
+		auto a_stack = a->st;
+		auto locked = sa::stats().locked_stacks;
+		delete a;
+		assert(sa::stats().locked_stacks == locked - 1);
+		// Gets the stack a just released, rather than the one b still uses.
+		sa::vector<int> c;
+		assert(c.st == a_stack);
+		for (int i = 0; i < 1000; i++) c.push_back(i * 2);
+		assert((*b)[999] == -999 && b->size() == 1000);
+		(void)a_stack;
+		(void)locked;
+		delete b;
+	}
+
+	// Vectors move in O(1), taking their stack with them, so they can be
+	// returned from functions and kept in optionals.
+	{
+		auto make_squares = [](int n) {
+			sa::vector<long long> v;
+			for (int i = 0; i < n; i++) v.push_back((long long)i * i);
+			return v;
+		};
+		static_assert(std::is_nothrow_move_constructible<sa::vector<long long>>::value &&
+					  std::is_nothrow_move_assignable<sa::vector<long long>>::value,
+					  "moves can't fail, which std containers and algorithms check for");
+		auto squares = make_squares(100000);
+		auto first = &squares[0];
+		std::optional<sa::vector<long long>> kept(std::move(squares));
+		assert(!squares.st && squares.size() == 0);
+		// Moved-from vectors need a new one assigned before they can be reused.
+		squares = sa::vector<long long>();
+		squares.push_back(-1);
+		assert(squares.st && squares[0] == -1);
+		assert(&(*kept)[0] == first && kept->size() == 100000);
+		auto copy = kept->clone();
+		copy[1] = -1;
+		assert((*kept)[1] == 1 && copy.size() == 100000 && copy.st != kept->st);
+		auto locked = sa::stats().locked_stacks;
+		copy = std::move(*kept);
+		assert(sa::stats().locked_stacks == locked - 1 && copy[1] == 1);
+		kept.reset();
+		sa::vector<std::string> strs;
+		strs.push_back("long enough to be allocated on the heap");
+		auto strs2 = strs.clone();
+		assert(strs2[0] == strs[0] && strs2[0].data() != strs[0].data());
+		(void)first;
+		(void)locked;
+	}
+
+	// Bulk operations, checked against simple loops, at sizes that exercise
+	// both the SIMD kernels and their tails.
+	for (int n : { 1, 7, 33, 1000 }) {
+		sa::vector<int> vi;
+		sa::vector<float> vf;
+		for (int i = 0; i < n; i++) {
+			vi.push_back((i * 7919) % 1013 - 500);
+			vf.push_back(vi[i] * 0.5f);
+		}
+		int imin = vi[0], imax = vi[0], isum = 0;
+		for (int i = 0; i < n; i++) {
+			imin = std::min(imin, vi[i]);
+			imax = std::max(imax, vi[i]);
+			isum += vi[i];
+		}
+		assert(vi.min() == imin && vi.max() == imax && vi.sum() == isum);
+		assert(vf.min() == imin * 0.5f && vf.max() == imax * 0.5f && vf.sum() == isum * 0.5f);
+		assert(vi.find(vi[n - 1]) == &vi[0] + (n - 1) || vi.count(vi[n - 1]) > 1);
+		assert(*vf.find(vf[n / 2]) == vf[n / 2] && !vf.find(1e6f));
+		assert(vi.count(12345) == 0);
+		vi.fill(3);
+		assert(vi.count(3) == (size_t)n && vi.sum() == 3 * n);
+		vi.transform([](int e) { return e * 2; });
+		assert(vi.max() == 6);
+		vf.append_range(vf.data(), vf.data() + n);
+		assert(vf.size() == 2 * (size_t)n);
+	}
+
+	// Everything lands aligned, regardless of what came before it.
+	{
+		struct alignas(32) Simd { float f[8]; };
+		sa::vector_max<char> scratch(13);
+		sa::vector_max<Simd> simd(4);
+		sa::vector_max<int> counters(16, sa::alignment{sa::cache_line_size});
+		sa::vector_max<char> page(1, sa::alignment{sa::system_page_size()});
+		assert(reinterpret_cast<size_t>(simd.begin) % alignof(Simd) == 0);
+		assert(reinterpret_cast<size_t>(counters.begin) % sa::cache_line_size == 0);
+		assert(reinterpret_cast<size_t>(page.begin) % sa::system_page_size() == 0);
+		sa::vector<Simd> v;
+		assert(reinterpret_cast<size_t>(v.begin) % alignof(Simd) == 0);
+		// Alignment is passed as its own type, as sa::vector<int> v(64)
+		// would read as 64 elements.
+		static_assert(!std::is_constructible<sa::vector<int>, size_t>::value, "");
+		sa::vector<int> wide(sa::alignment{256});
+		assert(reinterpret_cast<size_t>(wide.begin) % 256 == 0);
+		sa::vector_of_vectors<double, uint8_t> vv;
+		double d[] = { 1, 2 };
+		vv.push_back(d, 1);
+		auto n = vv.push_back(d, 2);
+		assert(reinterpret_cast<size_t>(n.begin()) % alignof(double) == 0);
+		assert(n.size() == 2 && n.begin()[1] == 2);
+		(void)n;
+	}
+
+	// Variable length records: lots of small strings without an allocation
+	// each, and a custom tagged union.
+	{
+		sa::record_log<sa::string_record<>, true> tokens;
+		const char *text = "the quick brown fox jumps over the lazy dog";
+		for (const char *p = text; *p;) {
+			auto len = strcspn(p, " ");
+			tokens.push_back(std::string_view(p, len));
+			p += len + (p[len] == ' ');
+		}
+		assert(tokens.size() == 9 && tokens[3] == "fox" && tokens[8] == "dog");
+		std::string joined;
+		for (auto t : tokens) joined += std::string(t) + " ";
+		assert(joined == std::string(text) + " ");
+
+		sa::record_log<value_record> values;
+		values.push_back(1.5);
+		values.push_back("odd length");
+		values.push_back(2.5);
+		double total = 0;
+		for (auto v : values) {
+			assert(reinterpret_cast<size_t>(v.payload) % alignof(double) == 0);
+			if (v.tag == 'd') total += *reinterpret_cast<double *>(v.payload);
+		}
+		assert(total == 4 && values.size() == 3);
+	}
+
+	// Immutable strings, one bump and memcpy each.
+	{
+		std::string_view key = "/api/v1/users";
+		sa::fixed_string a(key);
+		sa::fixed_string b("/api/v1/users");
+		sa::fixed_string c("/api/v1/orders");
+		assert(a == b && a != c && c < a && a == key && c != key);
+		assert(std::string_view(a) == key && a.size() == key.size() && a[0] == '/');
+		assert(a.data() != b.data());
+		assert(std::hash<sa::fixed_string>()(a) == std::hash<std::string_view>()(key));
+		int nums[] = { 3, 1, 2 };
+		sa::vector_fixed<int> v(nums, 3);
+		sa::vector_fixed<int> w(nums, 2);
+		assert(w < v && v != w && v[2] == 2);
+		assert(std::hash<sa::vector_fixed<int>>()(v) != std::hash<sa::vector_fixed<int>>()(w));
+	}
+
+	// Building text without reallocating.
+	{
+		sa::string_builder sb;
+		auto open = sb.append("{\"id\":");
+		sb.append(-1234567890123LL);
+		sb.append(",\"ratio\":");
+		auto ratio = sb.append(0.1);
+		sb.append(",\"count\":");
+		sb.append(18446744073709551615ULL);
+		sb.format(",\"name\":\"%s-%03d\"", "node", 7);
+		sb.append('}');
+		assert(sb.view() == "{\"id\":-1234567890123,\"ratio\":0.1,\"count\":18446744073709551615,\"name\":\"node-007\"}");
+		// Earlier pieces are still there.
+		assert(open == "{\"id\":" && ratio == "0.1");
+		(void)open;
+		(void)ratio;
+		assert(sb.append(1.0f / 3) == "0.33333334" && sb.append(uint8_t(255)) == "255");
+		assert(strlen(sb.c_str()) == sb.size());
+	}
+
+	// Sorting, by radix for numbers, and merging for everything else. Thread
+	// counts are forced so that the parallel paths run on any machine.
+	{
+		const size_t n = (1 << 20) + 7;
+		auto check = [&](auto &v, auto &expected, size_t threads) {
+			std::sort(expected.begin(), expected.end());
+			sa::parallel_sort(v, threads);
+			assert(std::equal(expected.begin(), expected.end(), v.data()));
+		};
+		for (size_t threads : { 1, 4, 7 }) {
+			sa::vector<int> ints;
+			std::vector<int> ints_expected;
+			sa::vector<double> doubles;
+			std::vector<double> doubles_expected;
+			sa::vector<uint64_t> longs;
+			std::vector<uint64_t> longs_expected;
+			for (size_t i = 0; i < n; i++) {
+				auto r = (uint64_t)rand() << 48 ^ (uint64_t)rand() << 24 ^ (uint64_t)rand();
+				ints.push_back((int)r);
+				ints_expected.push_back((int)r);
+				doubles.push_back(((int)r) * 0.25);
+				doubles_expected.push_back(((int)r) * 0.25);
+				longs.push_back(r);
+				longs_expected.push_back(r);
+			}
+			check(ints, ints_expected, threads);
+			check(doubles, doubles_expected, threads);
+			check(longs, longs_expected, threads);
+		}
+		// Comparators, on records that aren't numbers themselves.
+		struct record { int key; int payload; };
+		sa::vector<record> records;
+		for (size_t i = 0; i < n; i++) records.push_back({ rand() & 0xFFFF, (int)i });
+		sa::parallel_sort(records, [](const record &a, const record &b) { return a.key > b.key; }, 7);
+		for (size_t i = 1; i < n; i++) assert(records[i - 1].key >= records[i].key);
+		// Or radix sorted by a key, which keeps ties in order.
+		sa::parallel_sort(records, [](const record &r) { return r.payload % 1000; }, 7);
+		for (size_t i = 1; i < n; i++) {
+			auto a = records[i - 1].payload % 1000, b = records[i].payload % 1000;
+			assert(a < b || (a == b && records[i - 1].key >= records[i].key));
+			(void)a;
+			(void)b;
+		}
+		sa::vector<std::string> strs;
+		for (size_t i = 0; i < 300000; i++) strs.push_back(std::to_string(rand()) + " with enough text to allocate");
+		sa::parallel_sort(strs, 4);
+		for (size_t i = 1; i < strs.size(); i++) assert(strs[i - 1] <= strs[i]);
+		// Without a default constructor, scratch space holds moved elements.
+		struct named {
+			std::string name;
+			explicit named(std::string s) : name(std::move(s)) {}
+		};
+		sa::vector<named> names;
+		for (size_t i = 0; i < 300000; i++) names.emplace_back(std::to_string(rand()));
+		sa::parallel_sort(names, [](const named &a, const named &b) { return a.name < b.name; }, 4);
+		for (size_t i = 1; i < names.size(); i++) assert(names[i - 1].name <= names[i].name);
+	}
+
+	// Elements with constructors and destructors.
+	{
+		sa::vector<std::string> strs;
+		strs.push_back("a string long enough to be heap allocated");
+		std::string s = "moved rather than copied, also long enough";
+		strs.push_back(std::move(s));
+		auto &e = strs.emplace_back(3, 'x');
+		assert(e == "xxx" && strs.size() == 3);
+		(void)e;
+		strs.pop_back();
+		assert(strs.back()[0] == 'm');
+		sa::vector_max<std::unique_ptr<int>> ptrs(2);
+		ptrs.emplace_back(new int(1));
+		ptrs.push_back(std::make_unique<int>(2));
+		assert(*ptrs[1] == 2);
+		// Destructors run when these go out of scope, or leak checkers complain.
+	}
+
+	// Arbitrary allocations, all freed in one go.
+	{
+		static int destructed = 0;
+		struct Node {
+			Node *next;
+			std::string name;
+			Node(Node *next, const char *name) : next(next), name(name) {}
+			~Node() { destructed++; }
+		};
+		sa::scope request;
+		for (int i = 0; i < 2; i++) {
+			auto ints = request.alloc_array<int>(100);
+			assert(ints[99] == 0);
+			auto n1 = request.alloc<Node>(nullptr, "a long enough name to not fit in SSO");
+			auto n2 = request.alloc<Node>(n1, "b");
+			auto d = request.alloc<double>(1.5);
+			assert(reinterpret_cast<size_t>(d) % alignof(double) == 0 && *d == 1.5);
+			(void)ints;
+			(void)d;
+			{
+				// Vectors use their own stack while the scope is alive.
+				sa::vector<Node *> v;
+				v.push_back(n2);
+				assert(v[0]->next->name[0] == 'a');
+			}
+			request.rewind();
+			assert(destructed == 2 * (i + 1));
+		}
+	}
+
+	// Give memory back after a spike.
+	{
+		sa::reclaim_policy policy;
+		policy.enabled = true;
+		policy.keep_resident = 1 << 20;
+		policy.hysteresis = 1 << 20;
+		sa::set_reclaim_policy(policy);
+		uint8_t *data;
+		{
+			sa::vector<int> v;
+			for (int i = 0; i < 1 << 20; i++) v.push_back(i + 1);
+			data = v.begin;
+		}
+		// Beyond keep_resident, pages have been handed back to the OS, so come
+		// back zeroed.
+		assert(reinterpret_cast<int *>(data)[(1 << 20) - 1] == 0);
+		(void)data;
+		sa::set_reclaim_policy(sa::reclaim_policy());
+		// Only containers that lock their stack reclaim: a vector_max that
+		// goes away out of order doesn't take the pages of the vector that
+		// has been using its stack since.
+		sa::stack *spike_st;
+		{
+			sa::vector<int> spike;
+			for (int i = 0; i < 1 << 20; i++) spike.push_back(i);
+			spike_st = spike.st;
+		}
+		sa::set_reclaim_policy(policy);
+		auto m = new sa::vector_max<int>(16);
+		sa::vector<int> v;
+		assert(v.st == m->st && v.st == spike_st);
+		for (int i = 0; i < 1 << 20; i++) v.push_back(i + 1);
+		delete m;
+		assert(v[1 << 19] == (1 << 19) + 1);
+		sa::set_reclaim_policy(sa::reclaim_policy());
+		(void)spike_st;
+	}
+
+	// Settings apply to threads that start using stacks afterwards.
+	{
+		auto cfg = sa::current_config();
+		auto old = cfg;
+		sa::vector<int> probe;
+		size_t main_size = 0, main_stacks = 0;
+		long main_thread = 0;
+		for (auto &ss : sa::stats().stacks) {
+			if (ss.memory == probe.st->memory) main_size = ss.reserved, main_thread = ss.thread;
+		}
+		for (auto &ss : sa::stats().stacks) main_stacks += ss.thread == main_thread;
+		cfg.stack_size = 1ULL << 30;
+		cfg.max_stacks_per_thread = 4;
+		sa::init(cfg);
+		std::thread([]() {
+			sa::vector<int> v1, v2, v3, v4;
+			assert(sa::stats().reserved_stacks >= 4);
+			for (auto &ss : sa::stats().stacks) {
+				if (ss.locked && ss.memory == v4.st->memory) assert(ss.reserved == 1ULL << 30);
+			}
+		}).join();
+		// This thread keeps reserving stacks of the size it started with.
+		std::vector<sa::vector<int>> more(main_stacks);
+		for (auto &ss : sa::stats().stacks) {
+			if (ss.thread == main_thread) assert(ss.reserved == main_size);
+		}
+		(void)main_size;
+		// Sizes are rounded to whole pages, and at least min_stack_size.
+		cfg.stack_size = (1ULL << 30) + 1;
+		cfg.min_stack_size = 5;
+		sa::init(cfg);
+		auto page = sa::system_page_size();
+		cfg = sa::current_config();
+		assert(cfg.stack_size % page == 0 && cfg.stack_size > 1ULL << 30);
+		assert(cfg.min_stack_size == page);
+		#ifndef _WIN32
+			// Sizes from the environment that don't parse are ignored.
+			setenv("SA_STACK_SIZE", "1.5G", 1);
+			cfg.stack_size = 1ULL << 30;
+			sa::init(cfg);
+			assert(sa::current_config().stack_size == 1ULL << 30);
+			setenv("SA_STACK_SIZE", "2G", 1);
+			sa::init(cfg);
+			assert(sa::current_config().stack_size == 2ULL << 30);
+			unsetenv("SA_STACK_SIZE");
+		#endif
+		(void)page;
+		sa::init(old);
+	}
+
+	// Reading files without copies.
+	{
+		const char *file_name = "stackalloc_test.tmp";
+		auto f = fopen(file_name, "wb");
+		for (int i = 0; i < 100000; i++) fwrite(&i, sizeof(int), 1, f);
+		fclose(f);
+		sa::vector<uint8_t> buf;
+		buf.push_back('!');
+		auto ok = sa::read_file(file_name, buf);
+		assert(ok && buf.size() == 1 + 100000 * sizeof(int));
+		int last;
+		memcpy(&last, buf.end - sizeof(int), sizeof(int));
+		assert(last == 99999);
+		assert(!sa::read_file("does not exist", buf));
+		remove(file_name);
+		(void)ok;
+		(void)last;
+	}
+
+	// Data that survives restarts.
+	#ifndef _WIN32
+	{
+		struct Record { int id; float score; };
+		const char *file_name = "stackalloc_test.persistent";
+		remove(file_name);
+		sa::offset_handle<Record> h;
+		for (int run = 0; run < 2; run++) {
+			sa::persistent_stack ps;
+			auto ok = ps.open(file_name, 1 << 30);
+			assert(ok);
+			(void)ok;
+			sa::persistent_vector<Record> records(ps);
+			assert(records.size() == (size_t)run * 1000);
+			for (int i = 0; i < 1000; i++) records.push_back({ run * 1000 + i, i * 0.5f });
+			if (!run) h = records.handle(500);
+			assert(h.get(ps)->id == 500);
+		}
+		remove(file_name);
+		// Files that aren't ours are left alone.
+		auto f = fopen(file_name, "wb");
+		fputs("not a persistent stack file", f);
+		fclose(f);
+		sa::persistent_stack ps;
+		auto ok = ps.open(file_name, 1 << 30);
+		struct stat st;
+		stat(file_name, &st);
+		assert(!ok && st.st_size == 27);
+		(void)ok;
+		remove(file_name);
+	}
+	#endif
+
+	// Passing data between processes.
+	#ifndef _WIN32
+	{
+		struct Record { int id; int payload[3]; };
+		char name[64];
+		snprintf(name, sizeof(name), "/stackalloc_test_%d", (int)getpid());
+		sa::shared_stack consumer_stack;
+		auto ok = consumer_stack.create(name, 1 << 30);
+		assert(ok);
+		(void)ok;
+		const int num_records = 100000, num_producers = 2;
+		pid_t pids[num_producers];
+		for (int p = 0; p < num_producers; p++) {
+			pids[p] = fork();
+			if (!pids[p]) {
+				// Producers, in different processes.
+				sa::shared_stack ss;
+				if (!ss.open(name)) _exit(1);
+				sa::shared_vector<Record> records(ss);
+				for (int i = 0; i < num_records; i++) records.push_back({ i, { p, i, i } });
+				_exit(0);
+			}
+		}
+		sa::shared_vector<Record> records(consumer_stack);
+		// Read records as they come in, each producer's in order.
+		int next_id[num_producers] = {};
+		bool exited[num_producers] = {};
+		int num_exited = 0;
+		for (int i = 0; i < num_records * num_producers; i++) {
+			while (records.size() <= (size_t)i) {
+				assert(num_exited < num_producers);
+				for (int p = 0; p < num_producers; p++) {
+					int status = 0;
+					if (!exited[p] && waitpid(pids[p], &status, WNOHANG) == pids[p]) {
+						assert(WIFEXITED(status) && !WEXITSTATUS(status));
+						exited[p] = true;
+						num_exited++;
+					}
+				}
+			}
+			auto &r = records[i];
+			assert(r.id == next_id[r.payload[0]]++ && r.payload[2] == r.id);
+			(void)r;
+		}
+		(void)next_id;
+		for (int p = 0; p < num_producers; p++) {
+			if (!exited[p]) waitpid(pids[p], nullptr, 0);
+		}
+		sa::shared_stack::remove(name);
+	}
+	#endif
+
+	// Objects of all sorts of sizes from one pool.
+	{
+		struct Node { Node *left, *right; int value; };
+		struct Message { char body[1000]; };
+		sa::object_pool pool;
+		auto n1 = pool.create<Node>(Node { nullptr, nullptr, 1 });
+		auto n2 = pool.create<Node>(Node { n1, nullptr, 2 });
+		auto m = pool.create<Message>();
+		assert(reinterpret_cast<size_t>(m) % 1024 == 0 && m->body[999] == 0);
+		auto s = pool.create<std::string>("long enough to need its own allocation");
+		pool.destroy(n1);
+		// Freed slots get reused first.
+		auto n3 = pool.create<Node>(Node { nullptr, n2, 3 });
+		assert(n3 == n1 && n3->right->value == 2);
+		(void)n3;
+		pool.destroy(s);
+		pool.destroy(m);
+		auto raw = pool.alloc(3000);
+		pool.free(raw, 3000);
+	}
+
+	// References into a hash_map stay valid as it grows.
+	{
+		auto locked = sa::stats().locked_stacks;
+		sa::hash_map<std::string, int> symbols;
+		// Entries don't need handles, so don't take a stack for generations.
+		assert(sa::stats().locked_stacks == locked + 3);
+		(void)locked;
+		auto &first = symbols["first"];
+		first = 1;
+		for (int i = 0; i < 1000; i++) symbols.insert("sym" + std::to_string(i), i);
+		assert(&first == symbols.find("first") && first == 1);
+		assert(!symbols.insert("sym5", 42).second && *symbols.find("sym5") == 5);
+		assert(symbols.erase("sym5") && !symbols.erase("sym5") && !symbols.contains("sym5"));
+		symbols["sym5"] = 55;
+		assert(symbols.size() == 1001 && *symbols.find("sym5") == 55);
+		int total = 0;
+		symbols.for_each([&](const std::string &, int v) { total += v; });
+		assert(total == 1 + 999 * 1000 / 2 - 5 + 55);
+	}
+
+	// Many threads appending to the same vector.
+	{
+		sa::concurrent_vector<int> log;
+		const int num_threads = 8, per_thread = 100000;
+		std::vector<std::thread> writers;
+		std::thread reader([&]() {
+			size_t seen = 0;
+			while (seen < (size_t)num_threads * per_thread) {
+				auto snap = log.snapshot();
+				assert(snap.size() >= seen);
+				// Everything in a snapshot has been completely written.
+				for (size_t i = seen; i < snap.size(); i++) assert(snap[i] > 0);
+				seen = snap.size();
+			}
+		});
+		for (int t = 0; t < num_threads; t++) {
+			writers.emplace_back([&]() {
+				for (int i = 0; i < per_thread; i += 4) {
+					if (i % 8) {
+						int four[] = { i + 1, i + 2, i + 3, i + 4 };
+						log.push_multiple(four, 4);
+					} else {
+						for (int j = 1; j <= 4; j++) log.push_back(i + j);
+					}
+				}
+			});
+		}
+		for (auto &w : writers) w.join();
+		reader.join();
+		auto all = log.snapshot();
+		assert(all.size() == (size_t)num_threads * per_thread);
+		long long total = 0;
+		for (auto e : all) total += e;
+		assert(total == (long long)num_threads * per_thread * (per_thread + 1) / 2);
+		(void)total;
+	}
+
+	// Claimed but unpublished slots stay invisible, even when the memory
+	// under the completion flags is left over from other vectors.
+	{
+		{
+			sa::vector<uint32_t> dirty1, dirty2;
+			for (int i = 0; i < 10000; i++) {
+				dirty1.push_back(1);
+				dirty2.push_back(1);
+			}
+		}
+		sa::concurrent_vector<int> cv;
+		auto i = cv.claim(10);
+		assert(i == 0 && cv.size() == 0 && cv.snapshot().size() == 0);
+		for (int j = 0; j < 10; j++) new (cv.slot(i + j)) int(j);
+		cv.publish(i, 10);
+		assert(cv.size() == 10 && cv.snapshot()[9] == 9);
+	}
+
+	// Usage statistics.
+	{
+		sa::vector<int> v;
+		for (int i = 0; i < 100000; i++) v.push_back(i);
+		auto before = sa::stats();
+		assert(before.locked_stacks >= 1 && before.reserved_stacks >= before.locked_stacks);
+		assert(before.stacks.size() == before.reserved_stacks);
+		{
+			sa::vector<int> w;
+			w.push_back(1);
+		}
+		auto after = sa::stats();
+		assert(after.locked_stacks == before.locked_stacks);
+		#if SA_STATS
+			assert(after.acquires == before.acquires + 1 && after.releases == before.releases + 1);
+			assert(after.peak_locked >= 2);
+		#endif
+		// Memory of containers that are still alive shows up.
+		sa::vector<char> big;
+		const size_t big_size = 16 << 20;
+		for (size_t i = 0; i < big_size; i++) big.push_back(1);
+		size_t resident = 0;
+		for (auto &ss : sa::stats().stacks) {
+			if (ss.memory == big.st->memory) resident = ss.resident;
+		}
+		assert(resident >= big_size);
+		(void)resident;
+	}
+
+	// Each thread gets its own stacks, so vectors can be used concurrently.
+	{
+		std::vector<std::thread> workers;
+		for (int t = 0; t < 4; t++) {
+			workers.emplace_back([t]() {
+				sa::vector<int> v;
+				for (int i = 0; i < 100000; i++) v.push_back(i + t);
+				sa::vector<int> w;
+				w.push_back(t);
+				assert(v.size() == 100000 && v[99999] == 99999 + t);
+				assert(w.size() == 1 && w[0] == t);
+			});
+		}
+		for (auto &w : workers) w.join();
+	}
+
+	if (bench) {
+		run_benchmarks();
+		for (int i = 1; i + 1 < argc; i++) {
+			if (!strcmp(argv[i], "--csv")) write_bench_results(argv[i + 1], false);
+			if (!strcmp(argv[i], "--json")) write_bench_results(argv[i + 1], true);
+		}
 	}
 
  	return 0;